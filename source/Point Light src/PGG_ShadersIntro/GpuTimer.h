@@ -0,0 +1,112 @@
+#ifndef __GPUTIMER_H__
+#define __GPUTIMER_H__
+
+#include "glew.h"
+
+// Measures how long a block of GL commands takes on the GPU with GL_TIME_ELAPSED queries
+// Results are read back a few frames later, only once they are available, so timing never stalls the CPU
+class GpuTimer
+{
+public:
+	GpuTimer()
+	{
+		glGenQueries(NUM_QUERIES, _queries);
+		for (int i = 0; i < NUM_QUERIES; i++)
+		{
+			_pending[i] = false;
+		}
+		_next = 0;
+		_running = false;
+		_warmedUp = false;
+		_lastMs = 0.0;
+		Reset();
+	}
+
+	~GpuTimer()
+	{
+		glDeleteQueries(NUM_QUERIES, _queries);
+	}
+
+	// Starts timing, skipped if every query is still waiting for its result
+	void Begin()
+	{
+		Collect();
+		if (_pending[_next])
+		{
+			return;
+		}
+		glBeginQuery(GL_TIME_ELAPSED, _queries[_next]);
+		_running = true;
+	}
+
+	void End()
+	{
+		if (!_running)
+		{
+			return;
+		}
+		glEndQuery(GL_TIME_ELAPSED);
+		_pending[_next] = true;
+		_next = (_next + 1) % NUM_QUERIES;
+		_running = false;
+	}
+
+	// Average of every result collected since the last Reset, in milliseconds
+	double GetAverageMs() const { return _numSamples > 0 ? _totalMs / _numSamples : 0.0; }
+	unsigned int GetNumSamples() const { return _numSamples; }
+
+	// The most recent result, 0 until there is one
+	double GetLastMs() const { return _lastMs; }
+
+	void Reset()
+	{
+		_totalMs = 0.0;
+		_numSamples = 0;
+	}
+
+private:
+	enum { NUM_QUERIES = 4 };
+
+	// Picks up the results of any queries the GPU has finished with
+	void Collect()
+	{
+		for (int i = 0; i < NUM_QUERIES; i++)
+		{
+			if (!_pending[i])
+			{
+				continue;
+			}
+
+			GLint available = 0;
+			glGetQueryObjectiv(_queries[i], GL_QUERY_RESULT_AVAILABLE, &available);
+			if (available)
+			{
+				GLuint64 elapsed = 0;
+				glGetQueryObjectui64v(_queries[i], GL_QUERY_RESULT, &elapsed);
+				_pending[i] = false;
+
+				//The first pass pays for the driver finishing off the program, and some drivers report garbage for it, so leave it out
+				if (!_warmedUp)
+				{
+					_warmedUp = true;
+					continue;
+				}
+				_lastMs = elapsed / 1000000.0;
+				_totalMs += _lastMs;
+				_numSamples++;
+			}
+		}
+	}
+
+	GLuint _queries[NUM_QUERIES];
+	bool _pending[NUM_QUERIES];
+	int _next;
+	bool _running;
+	bool _warmedUp;
+
+	double _totalMs;
+	double _lastMs;
+	unsigned int _numSamples;
+};
+
+#endif
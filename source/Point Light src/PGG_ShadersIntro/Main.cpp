@@ -9,6 +9,10 @@
 #include "glew.h"
 #include "Scene.h"
 #include "Shader.h"
+#include "GpuTimer.h"
+#include "ShadowAtlas.h"
+#include "ShadowMoments.h"
+#include "ShaderLibrary.h"
 
 // iostream is so we can output error messages to console
 #include <iostream>
@@ -16,6 +20,8 @@
 #include <fstream>
 
 #include <chrono>
+#include <cstring>
+#include <cstdlib>
 
 GLenum glCheckError_(const char* file, int line)
 {
@@ -39,6 +45,49 @@ GLenum glCheckError_(const char* file, int line)
 	return errorCode;
 }
 
+//Renders every light's shadow tiles in the atlas with one of the two depth pass paths and times it on the GPU.
+//The layered path draws every object once per tile it touches and lets the vertex shader pick the tile, the other path amplifies in the geometry shader.
+void DrawDepthPass(Scene& scene, Shader& shader, bool layered, GpuTimer& timer, ShadowAtlas& shadowAtlas)
+{
+	timer.Begin();
+	scene.DrawShadowCasters(shader, layered, shadowAtlas);
+	timer.End();
+}
+
+//Times one of the depth pass paths drawing this frame's moving casters into the profiling framebuffer, the atlas is left alone
+void ProfileDepthPath(Scene& scene, Shader& shader, bool layered, GpuTimer& timer, GLuint framebuffer)
+{
+	glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+	timer.Begin();
+	scene.DrawDynamicShadowCasters(shader, layered);
+	timer.End();
+}
+
+
+//KHR_parallel_shader_compile is newer than this GLEW, so its entry point is looked up by hand
+#define GL_MAX_SHADER_COMPILER_THREADS_KHR 0x91B0
+typedef void (GLAPIENTRY *PFNGLMAXSHADERCOMPILERTHREADSKHRPROC)(GLuint count);
+
+//Whether the context has the extension, GLEW 1.11 doesn't know about every extension it might
+bool HasGLExtension(const char* name)
+{
+	GLint numExtensions = 0;
+	glGetIntegerv(GL_NUM_EXTENSIONS, &numExtensions);
+	for (GLint i = 0; i < numExtensions; i++)
+	{
+		if (strcmp((const char*)glGetStringi(GL_EXTENSIONS, i), name) == 0)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+//Milliseconds between two points of the startup
+long long ElapsedMs(std::chrono::steady_clock::time_point from, std::chrono::steady_clock::time_point to)
+{
+	return (long long)std::chrono::duration_cast<std::chrono::milliseconds>(to - from).count();
+}
 
 // An initialisation function, mainly for GLEW
 // This will also print to console the version of OpenGL we are using
@@ -62,6 +111,17 @@ bool InitGL()
 	std::cout<<"INFO: OpenGL Renderer: "<< glGetString( GL_RENDERER ) << std::endl;
 	std::cout<<"INFO: OpenGL Version: "<< glGetString( GL_VERSION ) << std::endl;
 	std::cout<<"INFO: OpenGL Shading Language Version: "<< glGetString( GL_SHADING_LANGUAGE_VERSION ) << std::endl;
+
+	//Let the driver compile on as many threads as it likes, so the shaders submitted at startup build side by side and in the background
+	if (HasGLExtension("GL_KHR_parallel_shader_compile"))
+	{
+		PFNGLMAXSHADERCOMPILERTHREADSKHRPROC glMaxShaderCompilerThreadsKHR = (PFNGLMAXSHADERCOMPILERTHREADSKHRPROC)SDL_GL_GetProcAddress("glMaxShaderCompilerThreadsKHR");
+		if (glMaxShaderCompilerThreadsKHR)
+		{
+			glMaxShaderCompilerThreadsKHR(0xFFFFFFFF);
+			std::cout<<"INFO: Parallel shader compile enabled"<<std::endl;
+		}
+	}
 	
 	return true;
 }
@@ -70,7 +130,7 @@ bool InitGL()
 int main(int argc, char *argv[])
 {
 	//Get time
-	std::chrono::steady_clock::time_point time1 = std::chrono::high_resolution_clock::now();
+	std::chrono::steady_clock::time_point time1 = std::chrono::steady_clock::now();
 
 	// This is our initialisation phase
 
@@ -157,6 +217,17 @@ int main(int argc, char *argv[])
 		return -1;
 	}
 
+	//Linked programs are kept between runs in the user's app data folder, so only the first run has to compile them
+	char* shaderCachePath = SDL_GetPrefPath("PGG_ShadersIntro", "PointLightShaderCache");
+	if (shaderCachePath)
+	{
+		Shader::SetBinaryCacheDirectory(shaderCachePath);
+		SDL_free(shaderCachePath);
+	}
+
+	//Shader files edited while it runs are rebuilt in the background, see Shader::StartReloadThread
+	Shader::StartReloadThread(window);
+
 
 	
 	// We are going to work out how much time passes from frame to frame
@@ -170,72 +241,85 @@ int main(int argc, char *argv[])
 	glEnable(GL_DEPTH_TEST);
 
 	//Shaders
-	Shader depthShader("vertDepthShader.txt", "fragDepthShader.txt", "geometryDepthShader.txt");
-	Shader defaultShader("vertShader.txt", "fragShader.txt");
+	//Every program is submitted up front and only waited for once the rest of the startup is done, so they compile alongside it
+	std::chrono::steady_clock::time_point shadersStart = std::chrono::steady_clock::now();
+	Shader depthShader("vertDepthShader.txt", nullptr, "geometryDepthShader.txt");
+	//The lit shader is compiled once for every shadow variant that gets used, the variant is its feature mask
+	ShaderLibrary shaderLibrary;
+	unsigned int litProgram = shaderLibrary.AddProgram("vertShader.txt", "fragShader.txt", nullptr, ShadowVariant::GetFeatureDefines);
+
+	//The variant the scene starts with is the point lights' original look, a wide filter with a constant bias
+	ShadowVariant startVariant;
+	startVariant.kernelSize = 5;
+	startVariant.bias = ShadowVariant::BIAS_CONSTANT;
+	Shader& startLitShader = shaderLibrary.Get(litProgram, startVariant.GetFeatures());
+
+	//The vertex shader picks each instance's shadow tile itself, so the depth pass can skip the geometry shader
+	Shader layeredDepthShader("vertLayeredDepthShader.txt", nullptr);
+	std::chrono::steady_clock::time_point shadersSubmitted = std::chrono::steady_clock::now();
 
 	////////////////////////////////////////////////////////////////////
-	const unsigned int SHADOW_WIDTH = 640, SHADOW_HEIGHT = 640;
-
-	//Create framebuffer object for rendering depth map.
-	unsigned int depthMapFBO;
-	glGenFramebuffers(1, &depthMapFBO);
-
-	//Create the depth cubemap.
-	unsigned int depthCubeMap;
-	glGenTextures(1, &depthCubeMap);
+	//The atlas size and depth format are the whole shadow memory budget (twice over, with the static copies), tiles shrink and get evicted to fit however many lights are on.
+	//The depth pass has no fragment shader, each face gets the perspective depth between near and far planes fitted tightly around the scene, so 16 bits of depth is enough.
+	//GL_DEPTH_COMPONENT24 and GL_DEPTH_COMPONENT32F cost twice the memory for the precision a much larger scene would need.
+	const int SHADOW_ATLAS_SIZE = 4096, SHADOW_MIN_TILE_SIZE = 64;
+	const GLenum SHADOW_DEPTH_FORMAT = GL_DEPTH_COMPONENT16;
+	ShadowAtlas shadowAtlas(SHADOW_ATLAS_SIZE, SHADOW_MIN_TILE_SIZE, SHADOW_DEPTH_FORMAT);
+
+	//Blurred moments of every tile for EVSM, laid out like the atlas. Four half floats and the mipmaps make it around 180MB, on top of the atlas. It is only allocated once EVSM is first used.
+	//Its blur target only has to fit the largest tile a light is given
+	const int SHADOW_MAX_TILE_SIZE = 512;
+	ShadowMoments shadowMoments(SHADOW_ATLAS_SIZE, SHADOW_MIN_TILE_SIZE, SHADOW_MAX_TILE_SIZE);
+
+	//A light is six faces, each a tile in the atlas and another in the static copy
+	size_t lightBytes = 6 * 2 * (size_t)SHADOW_MAX_TILE_SIZE * SHADOW_MAX_TILE_SIZE * ShadowAtlas::GetDepthFormatBytes(shadowAtlas.GetDepthFormat());
+	std::cout << "INFO: shadow memory " << shadowAtlas.GetMemoryBytes() << " bytes atlas and static copy, EVSM adds " << shadowMoments.GetMemoryBytes()
+		<< " bytes moments and blur target once it is used" << std::endl;
+	std::cout << "INFO: a light at the largest tile size takes " << lightBytes << " bytes, the atlas fits " << shadowAtlas.GetMemoryBytes() / lightBytes
+		<< " of them before tiles shrink" << std::endl;
+	std::chrono::steady_clock::time_point texturesCreated = std::chrono::steady_clock::now();
 
-	//Create depth texture.
-	unsigned int depthMap;
-	glGenTextures(1, &depthMap);
-	glBindTexture(GL_TEXTURE_2D, depthMap);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT16, SHADOW_WIDTH, SHADOW_HEIGHT, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
+	/////////////////////////////////////////////////////////////////////////
 
-	//Assign each single cubemap face a 2D depth valued texture image.
-	glBindTexture(GL_TEXTURE_CUBE_MAP, depthCubeMap);
+	Scene myScene;
+	myScene.SetShadowVariant(startVariant);
 
-	for (int i = 0; i < 6; i++)
+	//Run with -cubes N to add a field of N static cubes, every pass should still draw all of them with its one multi-draw call
+	unsigned int cubeFieldSize = 0;
+	for (int i = 1; i + 1 < argc; i++)
 	{
-		glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, GL_DEPTH_COMPONENT,
-			SHADOW_WIDTH, SHADOW_HEIGHT, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
-
-	}
-
-	//Texture Parameters for 2D textures (depth texture).
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-
-	//Texture Parameters for the cube map.
-	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-
-	//Attach depth texture as FBO's depth buffer.
-	glBindFramebuffer(GL_FRAMEBUFFER, depthMapFBO);
-	glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, depthCubeMap, 0);	
-	glReadBuffer(GL_NONE);
-	
-	//Checks if the frame buffer is complete.
-	if (GL_FRAMEBUFFER_COMPLETE == glCheckFramebufferStatus(GL_FRAMEBUFFER)) {
-		std::cout << ("INFO: frame buffer success") << std::endl;
+		if (strcmp(argv[i], "-cubes") == 0)
+		{
+			cubeFieldSize = (unsigned int)strtoul(argv[i + 1], NULL, 10);
+		}
 	}
-	else {
-		std::cout << ("INFO: frame buffer fail");
+	if (cubeFieldSize > 0)
+	{
+		myScene.AddCubeField(cubeFieldSize);
+		std::cout << "INFO: added a field of " << cubeFieldSize << " cubes, the scene has " << myScene.GetNumObjects() << " objects" << std::endl;
 	}
+	std::chrono::steady_clock::time_point sceneCreated = std::chrono::steady_clock::now();
 
-	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	//Whatever compile time didn't fit behind the rest of the startup is waited for here
+	depthShader.finish();
+	layeredDepthShader.finish();
+	startLitShader.finish();
+	std::chrono::steady_clock::time_point shadersFinished = std::chrono::steady_clock::now();
 
-	/////////////////////////////////////////////////////////////////////////
+	std::cout << "INFO: Startup " << ElapsedMs(time1, shadersStart) << "ms window and GL, " << ElapsedMs(shadersStart, shadersSubmitted) << "ms submitting shaders, "
+		<< ElapsedMs(shadersSubmitted, texturesCreated) << "ms shadow textures, " << ElapsedMs(texturesCreated, sceneCreated) << "ms scene, "
+		<< ElapsedMs(sceneCreated, shadersFinished) << "ms waiting for shaders" << std::endl;
 
-	Scene myScene;
+	//Shadow updates are spread over frames, at most this many cube faces and roughly this much depth pass time a frame
+	//The nearest, brightest and most recently moved lights are redrawn first, distant shadows can lag a few frames behind
+	const unsigned int SHADOW_FACE_BUDGET = 8;
+	const float SHADOW_TIME_BUDGET_MS = 2.0f;
+	myScene.SetShadowUpdateBudget(SHADOW_FACE_BUDGET, SHADOW_TIME_BUDGET_MS);
 
 	glEnable(GL_DEPTH_TEST);
 
 	//Calculate how long the SDL initalisation took, setting models, etc.
-	std::chrono::steady_clock::time_point time2 = std::chrono::high_resolution_clock::now();
+	std::chrono::steady_clock::time_point time2 = std::chrono::steady_clock::now();
 	std::chrono::milliseconds milliseconds = std::chrono::duration_cast<std::chrono::milliseconds>(time2 - time1);
 
 	std::cout << "Time taken: " << milliseconds.count() << std::endl;
@@ -261,15 +345,47 @@ int main(int argc, char *argv[])
 	//   * Update our world
 	//   * Draw our world
 	// We will come back to this in later lectures
+
+	//GPU time of the depth pass, the layered path, which the scheduler's time budget is measured against
+	GpuTimer depthPassTimer;
+
+	//Pressing G profiles the geometry shader path against the layered one, index 0 and 1, every DEPTH_PROFILE_INTERVAL frames.
+	//Both redraw only the moving casters, into a framebuffer with no attachments so the atlas is untouched and it takes no memory.
+	//That still costs GPU time outside the scheduler's budget, so it is off to start with.
+	GpuTimer profileTimers[2];
+	const int DEPTH_PROFILE_INTERVAL = 10;
+	int frameCount = 0;
+	bool profileDepthPaths = false;
+	GLuint profileFramebuffer = 0;
+	glGenFramebuffers(1, &profileFramebuffer);
+	glBindFramebuffer(GL_FRAMEBUFFER, profileFramebuffer);
+	glFramebufferParameteri(GL_FRAMEBUFFER, GL_FRAMEBUFFER_DEFAULT_WIDTH, SHADOW_ATLAS_SIZE);
+	glFramebufferParameteri(GL_FRAMEBUFFER, GL_FRAMEBUFFER_DEFAULT_HEIGHT, SHADOW_ATLAS_SIZE);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+	//With a cube field the first frame's lit pass is counted, every object has to come out of the one call
+	GLuint cubeFieldQuery = 0;
+	if (cubeFieldSize > 0)
+	{
+		glGenQueries(1, &cubeFieldQuery);
+	}
+
 	bool go = true;
 	while( go )
 	{
+		//Swap in the programs whose source files were edited, before anything this frame is drawn with them
+		Shader::ReloadChangedSources();
+
 		// Here we are going to check for any input events
 		// Basically when you press the keyboard or move the mouse, the parameters are stored as something called an 'event'
 		// SDL has a queue of events
 		// We need to check for each event and then do something about it (called 'event handling')
 		// the SDL_Event is the datatype for the event
 		SDL_Event incomingEvent;
+
+		//The shadow keys edit a copy of the scene's variant and hand it back
+		ShadowVariant shadowVariant;
+
 		// SDL_PollEvent will check if there is an event in the queue
 		// If there's nothing in the queue it won't sit and wait around for an event to come along (there are functions which do this, and that can be useful too!)
 		// For an empty queue it will simply return 'false'
@@ -300,8 +416,43 @@ int main(int argc, char *argv[])
 				{
 				case SDLK_DOWN:
 					// You can put code in here that you want to run when the down arrow key is pressed
+					//Turn off the last shadowed point light
+					myScene.SetNumLights(myScene.GetNumLights() - 1);
 					break;
 				case SDLK_UP:
+					//Turn on another shadowed point light
+					myScene.SetNumLights(myScene.GetNumLights() + 1);
+					break;
+				case SDLK_v:
+					//Switch between PCF and EVSM shadows
+					shadowVariant = myScene.GetShadowVariant();
+					shadowVariant.technique = shadowVariant.technique == ShadowVariant::TECHNIQUE_PCF ? ShadowVariant::TECHNIQUE_EVSM : ShadowVariant::TECHNIQUE_PCF;
+					myScene.SetShadowVariant(shadowVariant);
+					break;
+				case SDLK_k:
+					//Go round the PCF kernel sizes, 3x3, 5x5 and 7x7
+					shadowVariant = myScene.GetShadowVariant();
+					shadowVariant.kernelSize = shadowVariant.kernelSize == 7 ? 3 : shadowVariant.kernelSize + 2;
+					myScene.SetShadowVariant(shadowVariant);
+					break;
+				case SDLK_p:
+					//Go round the PCF sample patterns, grid, Poisson and rotated Poisson
+					shadowVariant = myScene.GetShadowVariant();
+					shadowVariant.pattern = (ShadowVariant::SamplePattern)((shadowVariant.pattern + 1) % ShadowVariant::NUM_PATTERNS);
+					myScene.SetShadowVariant(shadowVariant);
+					break;
+				case SDLK_b:
+					//Switch between constant and slope scaled bias
+					shadowVariant = myScene.GetShadowVariant();
+					shadowVariant.bias = (ShadowVariant::BiasModel)((shadowVariant.bias + 1) % ShadowVariant::NUM_BIAS_MODELS);
+					myScene.SetShadowVariant(shadowVariant);
+					break;
+				case SDLK_g:
+					//Profile the geometry shader path against the layered one
+					profileDepthPaths = !profileDepthPaths;
+					profileTimers[0].Reset();
+					profileTimers[1].Reset();
+					std::cout << "INFO: depth pass profiling " << (profileDepthPaths ? "on" : "off") << std::endl;
 					break;
 				case SDLK_LEFT:
 					break;
@@ -362,15 +513,30 @@ int main(int argc, char *argv[])
 		lastTime = current;
 		
 		myScene.Update( deltaTs );
+
+
+		//Hand out this frame's shadow tiles, then upload the camera, light and object data once, both passes read it from the same buffers
+		shadowAtlas.BeginFrame();
+		myScene.UpdateUniformBuffers(shadowAtlas);
 	
 		//Draw our world
 
-		//1. Generate depth map
-		glBindFramebuffer(GL_FRAMEBUFFER, depthMapFBO);
-		glViewport(0, 0, SHADOW_WIDTH, SHADOW_HEIGHT);
-		glClear(GL_DEPTH_BUFFER_BIT);
-		myScene.Draw(depthShader, SHADOW_WIDTH, SHADOW_HEIGHT);
-		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		//1. Generate depth map, the scene binds the atlas framebuffers itself
+		//Skipped altogether when the scheduler has nothing to redraw this frame
+		if (myScene.GetNumDirtyFaces() > 0)
+		{
+			glViewport(0, 0, SHADOW_ATLAS_SIZE, SHADOW_ATLAS_SIZE);
+			DrawDepthPass(myScene, layeredDepthShader, true, depthPassTimer, shadowAtlas);
+			if (profileDepthPaths && frameCount % DEPTH_PROFILE_INTERVAL == 0)
+			{
+				ProfileDepthPath(myScene, depthShader, false, profileTimers[0], profileFramebuffer);
+				ProfileDepthPath(myScene, layeredDepthShader, true, profileTimers[1], profileFramebuffer);
+			}
+			glBindFramebuffer(GL_FRAMEBUFFER, 0);
+			frameCount++;
+		}
+		myScene.FilterShadowMoments(shadowMoments, shadowAtlas);
+		myScene.SetDepthPassTime((float)depthPassTimer.GetLastMs());
 		
 		//2. Render scene as normal with shadow mapping.
 		// This sets the viewport, which specifies the area of the window.
@@ -383,10 +549,36 @@ int main(int argc, char *argv[])
 		glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
 		
 		//Draw second scene with normal shaders
-		//Using GL_TEXTURE_CUBE_MAP to bind a cubemap texture
-		//If you want to see the depth shader change the "mySceneDraw.(defaultShader)" to "mySceneDraw.(depthShader)"
-		glBindTexture(GL_TEXTURE_CUBE_MAP, depthCubeMap);
-		myScene.Draw(defaultShader, SHADOW_WIDTH, SHADOW_HEIGHT);
+		//The shadow atlas is a plain 2D texture, the shader finds each light's tiles from the light data and compares against them through the compare sampler
+		//If you want to see the depth shader change the lit shader passed to "myScene.Draw" to "depthShader"
+		glActiveTexture(GL_TEXTURE1);
+		glBindTexture(GL_TEXTURE_2D, shadowMoments.GetTexture());
+		glActiveTexture(GL_TEXTURE0);
+		glBindTexture(GL_TEXTURE_2D, shadowAtlas.GetTexture());
+		glBindSampler(0, shadowAtlas.GetCompareSampler());
+		if (cubeFieldQuery)
+		{
+			glBeginQuery(GL_PRIMITIVES_GENERATED, cubeFieldQuery);
+		}
+		myScene.Draw(shaderLibrary.Get(litProgram, myScene.GetShadowVariant().GetFeatures()));
+		if (cubeFieldQuery)
+		{
+			//Waits for the GPU, but only the once
+			glEndQuery(GL_PRIMITIVES_GENERATED);
+			GLuint triangles = 0;
+			glGetQueryObjectuiv(cubeFieldQuery, GL_QUERY_RESULT, &triangles);
+			if (triangles == myScene.GetNumObjectTriangles())
+			{
+				std::cout << "INFO: lit pass drew " << triangles << " triangles, all " << myScene.GetNumObjects() << " objects" << std::endl;
+			}
+			else
+			{
+				std::cerr << "ERROR: lit pass drew " << triangles << " triangles, " << myScene.GetNumObjects() << " objects should make " << myScene.GetNumObjectTriangles() << std::endl;
+			}
+			glDeleteQueries(1, &cubeFieldQuery);
+			cubeFieldQuery = 0;
+		}
+		glBindSampler(0, 0);
 
 
 
@@ -415,6 +607,27 @@ int main(int argc, char *argv[])
 			ss.str(std::string());
 			ss << "FPS: " << fps_frames;
 
+			//Depth pass time, and both paths' moving casters while profiling
+			ss.precision(3);
+			ss << " | Depth pass: " << depthPassTimer.GetAverageMs() << "ms";
+			if (profileDepthPaths)
+			{
+				ss << " | Moving casters GS: " << profileTimers[0].GetAverageMs() << "ms";
+				ss << " VS layer: " << profileTimers[1].GetAverageMs() << "ms";
+			}
+			ss << " | Shadow faces: " << myScene.GetNumShadowFaces() << "/" << myScene.GetNumObjects() * 6 * myScene.GetNumLights();
+			ss << " | Dirty faces: " << myScene.GetNumDirtyFaces() << "/" << 6 * myScene.GetNumLights() << " waiting: " << myScene.GetNumPendingFaces();
+			ss << " | " << myScene.GetShadowVariant().GetName() << " (" << shaderLibrary.GetNumPermutations(litProgram) << " compiled)";
+			ss << " | Atlas tiles: " << shadowAtlas.GetNumTiles() << " evicted: " << shadowAtlas.GetNumEvictions();
+			//The title has them anyway, they only go to the console as well while profiling
+			if (profileDepthPaths)
+			{
+				std::cout << "INFO: " << ss.str() << std::endl;
+			}
+			depthPassTimer.Reset();
+			profileTimers[0].Reset();
+			profileTimers[1].Reset();
+
 			//Input FPS into a txt file
 			fpsFile.open("fps_pointshadow.txt", std::ios_base::app); //App mode so the file doesn't overwrite the current data
 			if (fpsFile.is_open())
@@ -443,6 +656,8 @@ int main(int argc, char *argv[])
 
 
 	// Our cleanup phase, hopefully fairly self-explanatory ;)
+	glDeleteFramebuffers(1, &profileFramebuffer);
+	Shader::StopReloadThread();
 	SDL_GL_DeleteContext( glcontext );
 	SDL_DestroyWindow( window );
 	SDL_Quit();
@@ -0,0 +1,472 @@
+
+#include "ObjectTable.h"
+#include <cstring>
+#include <cfloat>
+#include <iostream>
+
+ObjectTable::ObjectTable()
+	: _layeredCommandsShader("compLayeredCommands.txt")
+{
+	_VAO = 0;
+	_positionVAO = 0;
+	_numVertices = 0;
+	_region = 0;
+	_uploaded = false;
+	_numStalls = 0;
+	_materialsDirty = false;
+	_commandsDirty = false;
+	_layerMasksDirty = false;
+	_layeredCommandsRevision = 0;
+	_staticVersion = 0;
+
+	for (int i = 0; i < NUM_DRAW_FILTERS * 2; i++)
+	{
+		_numCommands[i] = 0;
+	}
+
+	for (int i = 0; i < NUM_REGIONS; i++)
+	{
+		_regionFences[i] = 0;
+	}
+
+	//Without buffer storage we fall back to uploading each region with glBufferSubData
+	_persistent = GLEW_VERSION_4_4 || GLEW_ARB_buffer_storage;
+
+	//The table can grow until one region no longer fits in a shader storage block
+	GLint maxBlockSize = 1 << 27;
+	glGetIntegerv(GL_MAX_SHADER_STORAGE_BLOCK_SIZE, &maxBlockSize);
+	_maxCapacity = (unsigned int)(maxBlockSize / sizeof(ObjectData));
+
+	//Materials only change when one is added, so they get a plain buffer
+	glGenBuffers(1, &_materialBuffer);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, _materialBuffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(MaterialData) * MAX_MATERIALS, NULL, GL_STATIC_DRAW);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+	_capacity = INITIAL_CAPACITY;
+	CreateObjectBuffers();
+}
+
+ObjectTable::~ObjectTable()
+{
+	DeleteObjectBuffers();
+	glDeleteBuffers(1, &_materialBuffer);
+}
+
+void ObjectTable::CreateObjectBuffers()
+{
+	//Each region has to start on the driver's offset alignment so it can be bound with glBindBufferRange
+	GLint alignment = 256;
+	glGetIntegerv(GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT, &alignment);
+	_regionSize = ((sizeof(ObjectData) * _capacity + alignment - 1) / alignment) * alignment;
+
+	glGenBuffers(1, &_objectBuffer);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, _objectBuffer);
+
+	//Map the object buffer once and keep it mapped, writes go straight to memory the GPU can read
+	_mappedObjects = NULL;
+	if (_persistent)
+	{
+		GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		glBufferStorage(GL_SHADER_STORAGE_BUFFER, _regionSize * NUM_REGIONS, NULL, flags);
+		_mappedObjects = (unsigned char*)glMapBufferRange(GL_SHADER_STORAGE_BUFFER, 0, _regionSize * NUM_REGIONS, flags);
+		_persistent = _mappedObjects != NULL;
+	}
+	if (!_persistent)
+	{
+		glBufferData(GL_SHADER_STORAGE_BUFFER, _regionSize * NUM_REGIONS, NULL, GL_DYNAMIC_DRAW);
+	}
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+	glGenBuffers(1, &_indirectBuffer);
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, _indirectBuffer);
+	glBufferData(GL_DRAW_INDIRECT_BUFFER, sizeof(DrawArraysIndirectCommand) * _capacity * NUM_DRAW_FILTERS * 2, NULL, GL_STATIC_DRAW);
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+
+	//Instance i of a draw with baseInstance i reads element i, which is the object's index in the table
+	std::vector<GLuint> instances(_capacity);
+	for (unsigned int i = 0; i < _capacity; i++)
+	{
+		instances[i] = i;
+	}
+	glGenBuffers(1, &_instanceBuffer);
+	glBindBuffer(GL_ARRAY_BUFFER, _instanceBuffer);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(GLuint) * _capacity, &instances[0], GL_STATIC_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void ObjectTable::DeleteObjectBuffers()
+{
+	for (int i = 0; i < NUM_REGIONS; i++)
+	{
+		if (_regionFences[i])
+		{
+			glDeleteSync(_regionFences[i]);
+			_regionFences[i] = 0;
+		}
+	}
+
+	if (_persistent)
+	{
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, _objectBuffer);
+		glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+	}
+
+	glDeleteBuffers(1, &_objectBuffer);
+	glDeleteBuffers(1, &_indirectBuffer);
+	glDeleteBuffers(1, &_instanceBuffer);
+}
+
+void ObjectTable::Reserve(unsigned int capacity)
+{
+	if (capacity > _maxCapacity)
+	{
+		capacity = _maxCapacity;
+	}
+	if (capacity <= _capacity)
+	{
+		return;
+	}
+
+	//Frames still in flight keep reading the old buffers, the driver only frees them once the GPU is done with them
+	//So nothing has to wait here, the new buffers are simply filled from scratch by the next Upload
+	DeleteObjectBuffers();
+	_capacity = capacity;
+	CreateObjectBuffers();
+	AttachInstanceStream();
+	_commandsDirty = true;
+}
+
+unsigned int ObjectTable::AddMaterial(const glm::vec3& diffuseColour, const glm::vec3& emissiveColour)
+{
+	if (_materials.size() >= MAX_MATERIALS)
+	{
+		std::cerr << "ERROR: ObjectTable is full, cannot add more than " << MAX_MATERIALS << " materials" << std::endl;
+		return INVALID_ID;
+	}
+
+	MaterialData material;
+	material.diffuseColour = glm::vec4(diffuseColour, 1.0f);
+	material.emissiveColour = glm::vec4(emissiveColour, 1.0f);
+	_materials.push_back(material);
+	_materialsDirty = true;
+
+	return (unsigned int)_materials.size() - 1;
+}
+
+unsigned int ObjectTable::AddObject(unsigned int materialId)
+{
+	if (_objects.size() >= _maxCapacity)
+	{
+		std::cerr << "ERROR: ObjectTable is full, cannot add more than " << _maxCapacity << " objects" << std::endl;
+		return INVALID_ID;
+	}
+	if (materialId >= _materials.size())
+	{
+		std::cerr << "ERROR: ObjectTable has no material " << materialId << ", the object was not added" << std::endl;
+		return INVALID_ID;
+	}
+	if (_objects.size() >= _capacity)
+	{
+		Reserve(_capacity * 2);
+	}
+
+	//No layers and zero padding, the whole struct goes up to the GPU as it is
+	ObjectData object = {};
+	object.modelMat = glm::mat4(1.0f);
+	object.materialId = materialId;
+	_objects.push_back(object);
+	_static.push_back(0);
+	_commandsDirty = true;
+
+	return (unsigned int)_objects.size() - 1;
+}
+
+void ObjectTable::SetTransform(unsigned int objectId, const glm::mat4& modelMat)
+{
+	if (_static[objectId] && _objects[objectId].modelMat != modelMat)
+	{
+		_staticVersion++;
+	}
+	_objects[objectId].modelMat = modelMat;
+}
+
+void ObjectTable::SetStatic(unsigned int objectId, bool isStatic)
+{
+	if (IsStatic(objectId) != isStatic)
+	{
+		_static[objectId] = isStatic ? 1 : 0;
+		_staticVersion++;
+		_commandsDirty = true;
+	}
+}
+
+void ObjectTable::GetBounds(const glm::vec3& meshMin, const glm::vec3& meshMax, glm::vec3& boundsMin, glm::vec3& boundsMax) const
+{
+	glm::vec3 meshCentre = (meshMin + meshMax) * 0.5f;
+	glm::vec3 meshExtent = (meshMax - meshMin) * 0.5f;
+
+	boundsMin = glm::vec3(FLT_MAX);
+	boundsMax = glm::vec3(-FLT_MAX);
+	for (unsigned int i = 0; i < _objects.size(); i++)
+	{
+		AddObjectBounds(i, meshCentre, meshExtent, boundsMin, boundsMax);
+	}
+}
+
+void ObjectTable::GetBounds(const glm::vec3& meshMin, const glm::vec3& meshMax, const std::vector<unsigned int>& objectIds, glm::vec3& boundsMin, glm::vec3& boundsMax) const
+{
+	glm::vec3 meshCentre = (meshMin + meshMax) * 0.5f;
+	glm::vec3 meshExtent = (meshMax - meshMin) * 0.5f;
+
+	boundsMin = glm::vec3(FLT_MAX);
+	boundsMax = glm::vec3(-FLT_MAX);
+	for (unsigned int i = 0; i < objectIds.size(); i++)
+	{
+		AddObjectBounds(objectIds[i], meshCentre, meshExtent, boundsMin, boundsMax);
+	}
+}
+
+void ObjectTable::AddObjectBounds(unsigned int objectId, const glm::vec3& meshCentre, const glm::vec3& meshExtent, glm::vec3& boundsMin, glm::vec3& boundsMax) const
+{
+	//The transformed box's half size on each axis is the mesh's half size through the absolute matrix
+	const glm::mat4& modelMat = _objects[objectId].modelMat;
+	glm::vec3 centre = glm::vec3(modelMat * glm::vec4(meshCentre, 1.0f));
+	glm::vec3 extent = glm::abs(glm::vec3(modelMat[0])) * meshExtent.x + glm::abs(glm::vec3(modelMat[1])) * meshExtent.y + glm::abs(glm::vec3(modelMat[2])) * meshExtent.z;
+
+	boundsMin = glm::min(boundsMin, centre - extent);
+	boundsMax = glm::max(boundsMax, centre + extent);
+}
+
+void ObjectTable::SetLayerMask(unsigned int objectId, const unsigned int* layerMask)
+{
+	if (memcmp(_objects[objectId].layerMask, layerMask, sizeof(_objects[objectId].layerMask)) != 0)
+	{
+		memcpy(_objects[objectId].layerMask, layerMask, sizeof(_objects[objectId].layerMask));
+		_layerMasksDirty = true;
+	}
+}
+
+void ObjectTable::SetMesh(GLuint VAO, GLuint positionVAO, unsigned int numVertices)
+{
+	_VAO = VAO;
+	_positionVAO = positionVAO;
+	_numVertices = numVertices;
+	_commandsDirty = true;
+
+	AttachInstanceStream();
+}
+
+void ObjectTable::AttachInstanceStream()
+{
+	//The object index is an integer attribute that advances once per instance
+	//It goes through its own binding so Draw can change how often it advances with one call
+	GLuint VAOs[2] = { _VAO, _positionVAO };
+	for (int i = 0; i < 2; i++)
+	{
+		if (!VAOs[i])
+		{
+			continue;
+		}
+
+		glBindVertexArray(VAOs[i]);
+		glVertexAttribIFormat(OBJECT_INDEX_ATTRIB, 1, GL_UNSIGNED_INT, 0);
+		glVertexAttribBinding(OBJECT_INDEX_ATTRIB, INSTANCE_BINDING);
+		glEnableVertexAttribArray(OBJECT_INDEX_ATTRIB);
+		glVertexBindingDivisor(INSTANCE_BINDING, 1);
+		glBindVertexBuffer(INSTANCE_BINDING, _instanceBuffer, 0, sizeof(GLuint));
+	}
+	glBindVertexArray(0);
+}
+
+void ObjectTable::WaitForRegion(unsigned int region)
+{
+	if (!_regionFences[region])
+	{
+		return;
+	}
+
+	//With three regions the GPU has normally finished with this one long ago, so this returns straight away
+	GLenum result = glClientWaitSync(_regionFences[region], 0, 0);
+	if (result == GL_TIMEOUT_EXPIRED)
+	{
+		//The GPU is more than two frames behind, we have no choice but to wait for it
+		_numStalls++;
+		do
+		{
+			result = glClientWaitSync(_regionFences[region], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+		} while (result == GL_TIMEOUT_EXPIRED);
+	}
+
+	glDeleteSync(_regionFences[region]);
+	_regionFences[region] = 0;
+}
+
+void ObjectTable::Upload()
+{
+	if (_uploaded)
+	{
+		//Every pass that reads last frame's region has been submitted by now, so fence it and move on
+		if (_persistent)
+		{
+			_regionFences[_region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		}
+		_region = (_region + 1) % NUM_REGIONS;
+	}
+
+	GLintptr regionOffset = _regionSize * _region;
+	GLsizeiptr objectsSize = sizeof(ObjectData) * _objects.size();
+
+	if (_persistent)
+	{
+		WaitForRegion(_region);
+		if (objectsSize > 0)
+		{
+			memcpy(_mappedObjects + regionOffset, &_objects[0], objectsSize);
+		}
+	}
+	else if (objectsSize > 0)
+	{
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, _objectBuffer);
+		glBufferSubData(GL_SHADER_STORAGE_BUFFER, regionOffset, objectsSize, &_objects[0]);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+	}
+	_uploaded = true;
+
+	if (_materialsDirty && !_materials.empty())
+	{
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, _materialBuffer);
+		glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(MaterialData) * _materials.size(), &_materials[0]);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+		_materialsDirty = false;
+	}
+
+	//The commands only change when objects are added or made static or the mesh changes, not every frame
+	if (_commandsDirty && !_objects.empty())
+	{
+		WriteCommands();
+		_commandsDirty = false;
+		_layerMasksDirty = true;
+	}
+
+	if (objectsSize > 0)
+	{
+		glBindBufferRange(GL_SHADER_STORAGE_BUFFER, OBJECT_SSBO_BINDING, _objectBuffer, regionOffset, objectsSize);
+	}
+
+	//The masks are in the region just bound, so the instance counts are worked out on the GPU with nothing per object on the CPU
+	if (_layerMasksDirty && !_objects.empty())
+	{
+		CountLayeredInstances();
+		_layerMasksDirty = false;
+	}
+	if (!_materials.empty())
+	{
+		glBindBufferRange(GL_SHADER_STORAGE_BUFFER, MATERIAL_SSBO_BINDING, _materialBuffer, 0, sizeof(MaterialData) * _materials.size());
+	}
+}
+
+void ObjectTable::WriteCommands()
+{
+	//The layered commands are the same, their instance counts start at 0 until CountLayeredInstances fills them in
+	std::vector<DrawArraysIndirectCommand> commands;
+	for (int layered = 0; layered < 2; layered++)
+	{
+		for (int filter = 0; filter < NUM_DRAW_FILTERS; filter++)
+		{
+			//The filtered blocks are the same commands with the other kind of object left out
+			commands.clear();
+			for (unsigned int i = 0; i < _objects.size(); i++)
+			{
+				if (filter == DRAW_ALL || (filter == DRAW_STATIC) == (_static[i] != 0))
+				{
+					DrawArraysIndirectCommand command;
+					command.count = _numVertices;
+					command.instanceCount = layered ? 0 : 1;
+					command.first = 0;
+					command.baseInstance = i;
+					commands.push_back(command);
+				}
+			}
+
+			unsigned int block = layered * NUM_DRAW_FILTERS + filter;
+			_numCommands[block] = (unsigned int)commands.size();
+			if (!commands.empty())
+			{
+				glBindBuffer(GL_DRAW_INDIRECT_BUFFER, _indirectBuffer);
+				glBufferSubData(GL_DRAW_INDIRECT_BUFFER, sizeof(DrawArraysIndirectCommand) * _capacity * block,
+					sizeof(DrawArraysIndirectCommand) * commands.size(), &commands[0]);
+				glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+			}
+		}
+	}
+}
+
+void ObjectTable::CountLayeredInstances()
+{
+	if (_layeredCommandsShader.getRevision() != _layeredCommandsRevision)
+	{
+		_layeredCommandsRevision = _layeredCommandsShader.getRevision();
+		_firstCommand = _layeredCommandsShader.getUniform<int>("firstCommand");
+		_numBlockCommands = _layeredCommandsShader.getUniform<int>("numCommands");
+	}
+
+	//One invocation per command, it reads its object's mask from the region Upload bound
+	_layeredCommandsShader.use();
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, COMMAND_SSBO_BINDING, _indirectBuffer);
+	for (int filter = 0; filter < NUM_DRAW_FILTERS; filter++)
+	{
+		unsigned int block = NUM_DRAW_FILTERS + filter;
+		if (_numCommands[block] == 0)
+		{
+			continue;
+		}
+
+		_firstCommand.set((int)(_capacity * block));
+		_numBlockCommands.set((int)_numCommands[block]);
+		glDispatchCompute((_numCommands[block] + 63) / 64, 1, 1);
+	}
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, COMMAND_SSBO_BINDING, 0);
+	glUseProgram(0);
+
+	//The draws read the counts as commands, not through a storage block
+	glMemoryBarrier(GL_COMMAND_BARRIER_BIT);
+}
+
+void ObjectTable::Draw(bool layered, DrawFilter filter, bool positionsOnly)
+{
+	if (_objects.empty() || !_VAO)
+	{
+		return;
+	}
+
+	// Activate the VAO
+	glBindVertexArray(positionsOnly && _positionVAO ? _positionVAO : _VAO);
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, _indirectBuffer);
+
+	//Layered passes read the layered blocks of commands
+	//An object has at most MAX_LAYERS instances, so advancing the stream once every MAX_LAYERS keeps all of them on the object's own entry
+	unsigned int block = filter;
+	if (layered)
+	{
+		glVertexBindingDivisor(INSTANCE_BINDING, MAX_LAYERS);
+		block += NUM_DRAW_FILTERS;
+	}
+	GLintptr commandsOffset = sizeof(DrawArraysIndirectCommand) * _capacity * block;
+
+	// One call submits every object, however many there are
+	if (_numCommands[block] > 0)
+	{
+		glMultiDrawArraysIndirect(GL_TRIANGLES, (void*)commandsOffset, (GLsizei)_numCommands[block], 0);
+	}
+
+	if (layered)
+	{
+		glVertexBindingDivisor(INSTANCE_BINDING, 1);
+	}
+
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+	// Unbind VAO
+	glBindVertexArray(0);
+}
@@ -0,0 +1,181 @@
+#ifndef __OBJECTTABLE_H__
+#define __OBJECTTABLE_H__
+
+#include "glew.h"
+#include "Shader.h"
+#include <GLM/glm.hpp>
+#include <vector>
+
+// GPU-resident table of every object in the scene
+// Transforms and material IDs live in a persistent-mapped shader storage buffer that is written once per frame,
+// and every object of a pass is submitted with a single glMultiDrawArraysIndirect call
+class ObjectTable
+{
+public:
+	ObjectTable();
+	~ObjectTable();
+
+	// Buffer binding points and the instance attribute, these must match the shaders
+	enum { OBJECT_SSBO_BINDING = 2, MATERIAL_SSBO_BINDING = 3, COMMAND_SSBO_BINDING = 4, OBJECT_INDEX_ATTRIB = 3 };
+
+	// The object buffers start with room for INITIAL_CAPACITY objects and double whenever AddObject runs out
+	// Materials have a fixed capacity, their buffer is never reallocated
+	enum { INITIAL_CAPACITY = 1024, MAX_MATERIALS = 64 };
+
+	// Layered passes can draw into up to MAX_LAYERS layers, one bit each in an object's layer mask
+	enum { LAYER_MASK_WORDS = 8, MAX_LAYERS = LAYER_MASK_WORDS * 32 };
+
+	// Vertex buffer binding the instance stream is read through, clear of the bindings the mesh's own attributes use
+	enum { INSTANCE_BINDING = 3 };
+
+	// The object buffer is split in this many regions so the CPU writes one while the GPU reads the others
+	enum { NUM_REGIONS = 3 };
+
+	// Which objects a Draw submits, static objects are the ones that never move
+	enum DrawFilter { DRAW_ALL, DRAW_STATIC, DRAW_DYNAMIC, NUM_DRAW_FILTERS };
+
+	// std430 mirror of ObjectData in the shaders
+	struct ObjectData
+	{
+		glm::mat4 modelMat;
+		unsigned int materialId;
+		unsigned int layerMask[LAYER_MASK_WORDS];
+		unsigned int padding[3];
+	};
+
+	// std430 mirror of MaterialData in the shaders
+	struct MaterialData
+	{
+		glm::vec4 diffuseColour;
+		glm::vec4 emissiveColour;
+	};
+
+	// What AddMaterial and AddObject return when they can't add anything, it is never a valid ID
+	static const unsigned int INVALID_ID = 0xFFFFFFFFu;
+
+	// Adds a material and returns its ID, or INVALID_ID once there are MAX_MATERIALS
+	unsigned int AddMaterial(const glm::vec3& diffuseColour, const glm::vec3& emissiveColour);
+
+	// Adds an object using the given material and returns its ID, it starts with an identity transform
+	// Returns INVALID_ID if the table can't grow any more or the material doesn't exist
+	// Add objects before Upload, a table that has to grow reallocates its buffers
+	unsigned int AddObject(unsigned int materialId);
+
+	// Makes room for capacity objects up front, so adding a large number of them only reallocates the buffers once
+	void Reserve(unsigned int capacity);
+	unsigned int GetCapacity() const { return _capacity; }
+
+	void SetTransform(unsigned int objectId, const glm::mat4& modelMat);
+	const glm::mat4& GetTransform(unsigned int objectId) const { return _objects[objectId].modelMat; }
+
+	// Marks an object as static, objects start out dynamic
+	// Anything cached from the static objects, like their shadows, only needs redoing when GetStaticVersion changes
+	void SetStatic(unsigned int objectId, bool isStatic);
+	bool IsStatic(unsigned int objectId) const { return _static[objectId] != 0; }
+
+	// Goes up by one whenever an object becomes or stops being static, or a static object moves
+	unsigned int GetStaticVersion() const { return _staticVersion; }
+
+	// World space box around every object, or only the listed ones, given the box around the mesh in object space
+	void GetBounds(const glm::vec3& meshMin, const glm::vec3& meshMax, glm::vec3& boundsMin, glm::vec3& boundsMax) const;
+	void GetBounds(const glm::vec3& meshMin, const glm::vec3& meshMax, const std::vector<unsigned int>& objectIds, glm::vec3& boundsMin, glm::vec3& boundsMax) const;
+
+	// Layered passes only draw an object into the layers set in its mask, LAYER_MASK_WORDS words with layer n in bit n % 32 of word n / 32
+	// Objects start with no layers set. The masks go up with the transforms, so set them before Upload
+	void SetLayerMask(unsigned int objectId, const unsigned int* layerMask);
+
+	// Every object is drawn with this mesh, the instance stream is attached to its VAOs
+	// positionVAO reads the same vertices' positions alone, depth passes draw with it when there is one
+	void SetMesh(GLuint VAO, GLuint positionVAO, unsigned int numVertices);
+
+	// Writes this frame's transforms and layer masks into the next region of the object buffer and binds it
+	// If a mask changed, a compute pass counts the layered commands' instances from the masks on the GPU
+	// Call this once per frame, after the last SetTransform and before any of the Draw passes
+	void Upload();
+
+	// Draws every object that passes the filter with the currently bound program
+	// A layered draw instances each object once for every layer set in its layer mask, the shader finds its layer from gl_InstanceID and the mask
+	// A positionsOnly draw reads the mesh through its position VAO, for programs that use no other vertex attribute
+	void Draw(bool layered = false, DrawFilter filter = DRAW_ALL, bool positionsOnly = false);
+
+	unsigned int GetNumObjects() const { return (unsigned int)_objects.size(); }
+
+	// Number of times Upload found its region still in use by the GPU and had to wait
+	unsigned int GetNumStalls() const { return _numStalls; }
+
+protected:
+
+	// Layout of glMultiDrawArraysIndirect's commands
+	struct DrawArraysIndirectCommand
+	{
+		GLuint count;
+		GLuint instanceCount;
+		GLuint first;
+		GLuint baseInstance;
+	};
+
+	void WaitForRegion(unsigned int region);
+
+	// Grows the box to take in one object, given the centre and half size of the mesh's box
+	void AddObjectBounds(unsigned int objectId, const glm::vec3& meshCentre, const glm::vec3& meshExtent, glm::vec3& boundsMin, glm::vec3& boundsMax) const;
+
+	// Create and delete the buffers whose size follows the capacity, the object buffer's regions, the commands and the plain instance stream
+	void CreateObjectBuffers();
+	void DeleteObjectBuffers();
+
+	// Points the mesh's VAOs at the instance stream
+	void AttachInstanceStream();
+
+	// Fill the plain and the layered blocks of the indirect buffer, one command per object that passes each filter
+	void WriteCommands();
+
+	// Runs the compute pass that sets each layered command's instance count from its object's mask in the bound region
+	void CountLayeredInstances();
+
+	std::vector<ObjectData> _objects;
+	std::vector<MaterialData> _materials;
+
+	// One flag per object, kept out of ObjectData as the shaders never need it
+	std::vector<unsigned char> _static;
+	unsigned int _staticVersion;
+
+	// Room in the buffers, and the most objects the driver lets a shader storage block hold
+	unsigned int _capacity;
+	unsigned int _maxCapacity;
+
+	// Object buffer, NUM_REGIONS regions of _capacity objects each aligned for glBindBufferRange
+	GLuint _objectBuffer;
+	GLsizeiptr _regionSize;
+	unsigned char* _mappedObjects;
+	bool _persistent;
+	GLsync _regionFences[NUM_REGIONS];
+	unsigned int _region;
+	bool _uploaded;
+	unsigned int _numStalls;
+
+	GLuint _materialBuffer;
+	bool _materialsDirty;
+
+	// One command per object, baseInstance is the object's index and picks its entry in the instance stream
+	// Each block has room for _capacity commands, there is a block per filter that draws each object once, then a block per filter that draws it into its layers for layered passes
+	// The CPU only writes them when objects are added or made static or the mesh changes, the layered instance counts are written by the compute pass
+	GLuint _indirectBuffer;
+	unsigned int _numCommands[NUM_DRAW_FILTERS * 2];
+	bool _commandsDirty;
+	bool _layerMasksDirty;
+
+	// Sets the layered commands' instance counts, see compLayeredCommands.txt
+	Shader _layeredCommandsShader;
+	unsigned int _layeredCommandsRevision;
+	Uniform<int> _firstCommand;
+	Uniform<int> _numBlockCommands;
+
+	// Static instance stream holding i for every object the table has room for, this is how each instance finds its own object
+	GLuint _instanceBuffer;
+
+	GLuint _VAO;
+	GLuint _positionVAO;
+	unsigned int _numVertices;
+};
+
+#endif
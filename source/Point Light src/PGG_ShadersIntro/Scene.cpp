@@ -2,9 +2,13 @@
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <cstring>
 
 #include "Scene.h"
 #include "Shader.h"
+#include <algorithm>
+#include <cmath>
+#include <cfloat>
 
 Scene::Scene()
 {
@@ -16,18 +20,33 @@ Scene::Scene()
 	_cameraAngleX = 0.0f, _cameraAngleY = 0.0f;
 
 
-	_shaderModelMatLocation = 0;
-	_shaderViewMatLocation = 0;
-	_shaderProjMatLocation = 0;
-
-	_shaderDiffuseColLocation = 0;
-	_shaderEmissiveColLocation = 0;
-	_shaderWSLightPosLocation = 0;
-
-	
 	//_modelMatrixCube1;
 	_modelMatrixCube2 = glm::scale(glm::translate(glm::mat4(1.0f),glm::vec3(1.0f,0.0f,0.0f)),glm::vec3(0.1f,0.1f,0.1f));
 	_modelMatrixCube3 = glm::scale(glm::translate(glm::mat4(1.0f),glm::vec3(0.0f,-1.0f,0.0f)),glm::vec3(2.0f,0.1f,2.0f));
+
+	//Register the cubes with the object table, every one of them is drawn with the cube mesh
+	_objects.SetMesh(_cubeModel.GetVAO(), _cubeModel.GetPositionVAO(), _cubeModel.GetNumVertices());
+
+	/* Cube 1 */
+	_cube1Object = _objects.AddObject(_objects.AddMaterial(glm::vec3(1.0f, 0.3f, 0.3f), glm::vec3(0.0f, 0.0f, 0.0f)));
+
+	/* Cube 2 */
+	// Emissive colour for cube 2 is bright so it looks like a light
+	_cube2Object = _objects.AddObject(_objects.AddMaterial(glm::vec3(0.0f, 0.0f, 0.0f), glm::vec3(1.0f, 1.0f, 1.0f)));
+
+	/* Cube 3 */
+	_cube3Object = _objects.AddObject(_objects.AddMaterial(glm::vec3(0.3f, 0.3f, 1.0f), glm::vec3(0.0f, 0.0f, 0.0f)));
+	SetCubeTransform(_cube3Object, _modelMatrixCube3);
+	if (_cube1Object == ObjectTable::INVALID_ID || _cube2Object == ObjectTable::INVALID_ID || _cube3Object == ObjectTable::INVALID_ID)
+	{
+		std::cerr << "ERROR: Scene could not add every cube to the object table" << std::endl;
+	}
+
+	//The floor never moves, so its shadows are drawn once and cached in the atlas
+	if (_cube3Object != ObjectTable::INVALID_ID)
+	{
+		_objects.SetStatic(_cube3Object, true);
+	}
 	
 	// Set up the viewing matrix
 	// This represents the camera's orientation and position
@@ -43,21 +62,83 @@ Scene::Scene()
 	//Setting up light matrix
 	near_plane = 0.1f, far_plane = 10.0f;
 	lightPos = glm::vec3(-1.0f, 4.0f, 1.0f);
-	lightProjection = glm::ortho(-10.0f, 10.0f, -10.0f, 10.0f, near_plane, far_plane);
 	lightView = glm::lookAt
 				(lightPos, //lightPos
 				glm::vec3(0.0f, 0.0f, 0.0f),
 				glm::vec3(0.0f, 3.0f, 0.0f));
 	lightModelMatrix = glm::mat4(1.0f);
-	lightSpaceMatrix = lightModelMatrix * lightProjection * lightView;
 
-	//Shadow projection
-	shadowProj = glm::perspective(glm::radians(90.0f), aspect, near_plane, far_plane);
+	//The light projection and every shadow projection are fitted to the scene bounds, see UpdateSceneBounds
+	_sceneBoundsMin = glm::vec3(0.0f), _sceneBoundsMax = glm::vec3(0.0f);
+	_staticBoundsMin = glm::vec3(0.0f), _staticBoundsMax = glm::vec3(0.0f);
+	_staticBoundsDirty = true;
+
+	//Point lights, the first one is the scene's original light and the rest sit in a ring above the cubes
+	//Only the first light is on to start with, see SetNumLights
+	_pointLights.resize(MAX_POINT_LIGHTS);
+	const glm::vec3 lightColours[4] = { glm::vec3(1.0f, 0.5f, 0.5f), glm::vec3(0.5f, 1.0f, 0.5f), glm::vec3(0.5f, 0.5f, 1.0f), glm::vec3(1.0f, 1.0f, 0.5f) };
+	for (unsigned int i = 0; i < MAX_POINT_LIGHTS; i++)
+	{
+		float angle = 6.2831853f * (float)i / (float)(MAX_POINT_LIGHTS - 1);
+		_pointLights[i].position = glm::vec3(3.0f * cos(angle), 2.0f + 0.5f * (float)(i % 3), 3.0f * sin(angle));
+		_pointLights[i].colour = lightColours[i % 4] * 0.5f;
+		_pointLights[i].shadowDirty = true;
+		_pointLights[i].pendingFaces = 0;
+		_pointLights[i].pendingStaticFaces = 0;
+		_pointLights[i].dirtyFaces = 0;
+		_pointLights[i].staticFaces = 0;
+		_pointLights[i].validFaces = 0;
+		for (int face = 0; face < 6; face++)
+		{
+			_pointLights[i].shadowTiles[face] = glm::vec4(0.0f);
+			_pointLights[i].atlasTiles[face] = -1;
+			_pointLights[i].pendingFrames[face] = 0;
+		}
+
+		//Nothing is in shadow until the scheduler first builds the light
+		_pointLights[i].nearPlane = 0.01f, _pointLights[i].farPlane = FLT_MAX;
+	}
+	_pointLights[0].position = lightPos;
+	_pointLights[0].colour = glm::vec3(1.0f, 1.0f, 1.0f);
+	for (unsigned int i = 0; i < MAX_POINT_LIGHTS; i++)
+	{
+		_pointLights[i].shadowPosition = _pointLights[i].position;
+	}
+	_numLights = 1;
+
+	//No shadow transforms yet, so the first UpdateUniformBuffers builds and uploads them
+	_lightDataDirty = true;
+	_numShadowFaces = 0;
+	_numDirtyFaces = 0;
+	_numPendingFaces = 0;
+	_staticVersion = _objects.GetStaticVersion();
+	_previousNumLights = 0;
+
+	//No budget until SetShadowUpdateBudget is called, every pending face is redrawn straight away
+	_maxShadowFaces = MAX_POINT_LIGHTS * 6;
+	_maxShadowMs = 0.0f;
+	_msPerFace = 0.0f;
+	_averageFacesDrawn = 0.0f;
+	_shadowTileDistance = 5.0f;
+	_momentsDirty = true;
+
+	//Create the uniform buffer shared by every shader program
+	//The light block has to start on the driver's offset alignment so it can be bound with glBindBufferRange
+	GLint alignment = 256;
+	glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+	_lightBlockOffset = ((sizeof(FrameUniformData) + alignment - 1) / alignment) * alignment;
+	_uniformBufferSize = _lightBlockOffset + sizeof(LightUniformData);
+	_uniformStaging.resize(_uniformBufferSize);
 
+	glGenBuffers(1, &_uniformBuffer);
+	glBindBuffer(GL_UNIFORM_BUFFER, _uniformBuffer);
+	glBufferData(GL_UNIFORM_BUFFER, _uniformBufferSize, NULL, GL_DYNAMIC_DRAW);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
 }
 
 Scene::~Scene()
 {
+	glDeleteBuffers(1, &_uniformBuffer);
 }
 
 void Scene::Update( float deltaTs )
@@ -84,93 +165,875 @@ void Scene::Update( float deltaTs )
 	_modelMatrixCube2 = glm::scale(glm::translate(glm::rotate( glm::mat4(1.0f),-_cube2Angle, glm::vec3(0,1,0) ),glm::vec3(1.0f,0.0f,0.0f)),glm::vec3(0.1f,0.1f,0.1f));
 
 	_viewMatrix = glm::rotate( glm::rotate( glm::translate( glm::mat4(1.0f), glm::vec3(0,0,-3.5f) ), _cameraAngleX, glm::vec3(1,0,0) ), _cameraAngleY, glm::vec3(0,1,0) );
+
+	// Write this frame's transforms to the object table, both the depth pass and the lit pass draw from it
+	SetCubeTransform(_cube1Object, _modelMatrixCube1);
+	SetCubeTransform(_cube2Object, _modelMatrixCube2);
+	SetCubeTransform(_cube3Object, _modelMatrixCube3);
 }
 
-void Scene::Draw(Shader shader, int SHADOW_WIDTH, int SHADOW_HEIGHT)
+void Scene::SetCubeTransform(unsigned int object, const glm::mat4& modelMat)
 {
-		// Activate the shader program
-		//glUseProgram( _shaderProgram );
-		
-		//Use the program ID with my shader class
-		shader.use();
-	
-		// We use the small cube's model matrix to transform the light position
-		// This means the light will have the position of the small cube
-		shader.setVec4("worldSpaceLightPos", _modelMatrixCube2 * glm::vec4(0, 0, 0, 1) );
-		
+	if (object != ObjectTable::INVALID_ID)
+	{
+		//Only a dynamic object that really moved has its faces found again, see UpdatePendingFaces
+		if (!_objects.IsStatic(object) && _objects.GetTransform(object) != modelMat)
+		{
+			_movedObjects.push_back(object);
+		}
+		_objects.SetTransform(object, modelMat);
+	}
+}
+
+void Scene::AddCubeField(unsigned int count)
+{
+	//Room for the whole field up front, so the object buffers are only reallocated once
+	_objects.Reserve(_objects.GetNumObjects() + count);
+	unsigned int material = _objects.AddMaterial(glm::vec3(0.6f, 0.6f, 0.6f), glm::vec3(0.0f, 0.0f, 0.0f));
+	if (material == ObjectTable::INVALID_ID)
+	{
+		return;
+	}
+
+	//The floor is 2 units square with its top at -0.95, each cube sits on it a little smaller than its cell
+	unsigned int side = (unsigned int)ceil(sqrt((double)count));
+	float cellSize = 2.0f / (float)side;
+	for (unsigned int i = 0; i < count; i++)
+	{
+		glm::vec3 position(-1.0f + cellSize * ((float)(i % side) + 0.5f), -0.95f + cellSize * 0.4f, -1.0f + cellSize * ((float)(i / side) + 0.5f));
+		unsigned int object = _objects.AddObject(material);
+		if (object == ObjectTable::INVALID_ID)
+		{
+			//The table is full, AddObject has said so already
+			break;
+		}
+		_objects.SetTransform(object, glm::scale(glm::translate(glm::mat4(1.0f), position), glm::vec3(cellSize * 0.8f)));
+		_objects.SetStatic(object, true);
+	}
+}
+
+void Scene::SetNumLights(unsigned int numLights)
+{
+	if (numLights < 1)
+	{
+		numLights = 1;
+	}
+	if (numLights > MAX_POINT_LIGHTS)
+	{
+		numLights = MAX_POINT_LIGHTS;
+	}
 
-		//Set the shadow projection
-		shadowProj = glm::perspective(glm::radians(90.0f), (float)SHADOW_WIDTH / (float)SHADOW_HEIGHT, near_plane, far_plane);
+	if (numLights != _numLights)
+	{
+		_numLights = numLights;
+		_lightDataDirty = true;
+	}
+}
 
-		//Create 6 view directions
-		shadowTransforms.push_back(shadowProj *
-			glm::lookAt(lightPos, lightPos + glm::vec3(1.0, 0.0, 0.0), glm::vec3(0.0, -1.0, 0.0)));	// right direction
+bool Scene::UpdateSceneBounds()
+{
+	//Every object is a unit cube
+	if (_staticBoundsDirty)
+	{
+		_objects.GetBounds(glm::vec3(-0.5f), glm::vec3(0.5f), _staticObjects, _staticBoundsMin, _staticBoundsMax);
+		_staticBoundsDirty = false;
+	}
+	glm::vec3 boundsMin, boundsMax;
+	_objects.GetBounds(glm::vec3(-0.5f), glm::vec3(0.5f), _dynamicObjects, boundsMin, boundsMax);
+	boundsMin = glm::min(boundsMin, _staticBoundsMin);
+	boundsMax = glm::max(boundsMax, _staticBoundsMax);
 
-		shadowTransforms.push_back(shadowProj *
-			glm::lookAt(lightPos, lightPos + glm::vec3(-1.0, 0.0, 0.0), glm::vec3(0.0, -1.0, 0.0)));// left direction
+	//Round out to a quarter unit
+	boundsMin = glm::floor(boundsMin * 4.0f) / 4.0f;
+	boundsMax = glm::ceil(boundsMax * 4.0f) / 4.0f;
 
-		shadowTransforms.push_back(shadowProj *
-			glm::lookAt(lightPos, lightPos + glm::vec3(0.0, 1.0, 0.0), glm::vec3(0.0, 0.0, 1.0)));	// top direction
+	if (boundsMin == _sceneBoundsMin && boundsMax == _sceneBoundsMax)
+	{
+		return false;
+	}
+
+	_sceneBoundsMin = boundsMin, _sceneBoundsMax = boundsMax;
+	FitLightProjection();
+	return true;
+}
+
+void Scene::FitLightProjection()
+{
+	//Box around the scene bounds' corners in light view space, the light looks down -z
+	glm::vec3 lightMin(FLT_MAX), lightMax(-FLT_MAX);
+	for (int i = 0; i < 8; i++)
+	{
+		glm::vec3 corner((i & 1) ? _sceneBoundsMax.x : _sceneBoundsMin.x, (i & 2) ? _sceneBoundsMax.y : _sceneBoundsMin.y, (i & 4) ? _sceneBoundsMax.z : _sceneBoundsMin.z);
+		glm::vec3 lightSpaceCorner = glm::vec3(lightView * glm::vec4(corner, 1.0f));
+		lightMin = glm::min(lightMin, lightSpaceCorner);
+		lightMax = glm::max(lightMax, lightSpaceCorner);
+	}
 
-		shadowTransforms.push_back(shadowProj *
-			glm::lookAt(lightPos, lightPos + glm::vec3(0.0, -1.0, 0.0), glm::vec3(0.0, 0.0, -1.0)));	// bottom direction
+	near_plane = glm::max(-lightMax.z, 0.01f), far_plane = -lightMin.z;
+	lightProjection = glm::ortho(lightMin.x, lightMax.x, lightMin.y, lightMax.y, near_plane, far_plane);
+	lightSpaceMatrix = lightModelMatrix * lightProjection * lightView;
+	_lightDataDirty = true;
+}
 
-		shadowTransforms.push_back(shadowProj *
-			glm::lookAt(lightPos, lightPos + glm::vec3(0.0, 0.0, 1.0), glm::vec3(0.0, -1.0, 0.0)));	// near
+void Scene::SetShadowUpdateBudget(unsigned int maxFaces, float maxMs)
+{
+	_maxShadowFaces = maxFaces > 0 ? maxFaces : 1;
+	_maxShadowMs = maxMs;
+}
 
-		shadowTransforms.push_back(shadowProj *
-			glm::lookAt(lightPos, lightPos + glm::vec3(0.0, 0.0, -1.0), glm::vec3(0.0, -1.0, 0.0)));	// far
+void Scene::SetDepthPassTime(float ms)
+{
+	//The timer's results are a few frames old, so they are measured against the smoothed number of faces drawn
+	if (ms > 0.0f)
+	{
+		_msPerFace = ms / glm::max(_averageFacesDrawn, 1.0f);
+	}
+}
 
-		// Send view and projection matrices to OpenGL
-		shader.setVec3("lightPos", lightPos);
-		shader.setMat4("viewMat", _viewMatrix);
-		shader.setMat4("projMat", _projMatrix);
-		shader.setMat4("lightSpaceMatrix", lightSpaceMatrix);
-		shader.setFloat("far_plane", far_plane);
-		shader.setFloat("near_plane", near_plane);
-		shader.setFloat("depthMap", 0);
+void Scene::UpdateShadowTransforms()
+{
+	bool boundsChanged = UpdateSceneBounds();
 
-		for (int i = 0; i < 6; i++)
+	//Otherwise only the lights that moved need their cube-face matrices rebuilt
+	//Lights that are off are flagged for new bounds too, so they are rebuilt when they come back on
+	for (unsigned int i = 0; i < MAX_POINT_LIGHTS; i++)
+	{
+		PointLight& light = _pointLights[i];
+		if (boundsChanged || (i < _numLights && light.position != light.shadowPosition))
 		{
-			shader.setMat4("shadowMatrices[" + std::to_string(i) + "]", shadowTransforms[i]);
+			light.shadowDirty = true;
 		}
+	}
+}
 
-		/* Draw Cube 1 */
+void Scene::BuildShadowTransforms(PointLight& light)
+{
+	glm::vec3 lightPos = light.position;
+	light.shadowPosition = lightPos;
+	light.shadowDirty = false;
+	light.pendingStaticFaces = 0x3f;
 
-			// Set emissive colour component for cube 1
-			shader.setVec3("emissiveColour", 0.0f, 0.0f, 0.0f);
-			shader.setMat4("modelMat", _modelMatrixCube1);
-			// Set diffuse colour for cube 1
-			shader.setVec3("diffuseColour", 1.0f, 0.3f, 0.3f);
-				_cubeModel.Draw( );
+	//The far plane reaches the farthest corner of the scene bounds, the near plane stops short of the nearest point of them
+	glm::vec3 nearestPoint = glm::clamp(lightPos, _sceneBoundsMin, _sceneBoundsMax);
+	light.farPlane = 0.0f;
+	for (int i = 0; i < 8; i++)
+	{
+		glm::vec3 corner((i & 1) ? _sceneBoundsMax.x : _sceneBoundsMin.x, (i & 2) ? _sceneBoundsMax.y : _sceneBoundsMin.y, (i & 4) ? _sceneBoundsMax.z : _sceneBoundsMin.z);
+		light.farPlane = glm::max(light.farPlane, glm::length(corner - lightPos));
+	}
+	light.farPlane *= 1.01f;
+	light.nearPlane = glm::max(glm::length(nearestPoint - lightPos) * 0.9f, 0.01f);
 
-		
+	//Set the shadow projection, the tiles are always square
+	glm::mat4 shadowProj = glm::perspective(glm::radians(90.0f), aspect, light.nearPlane, light.farPlane);
 
+	//Create 6 view directions
+	light.shadowTransforms[0] = shadowProj *
+		glm::lookAt(lightPos, lightPos + glm::vec3(1.0, 0.0, 0.0), glm::vec3(0.0, -1.0, 0.0));	// right direction
 
-		/* Draw Cube 2 */
+	light.shadowTransforms[1] = shadowProj *
+		glm::lookAt(lightPos, lightPos + glm::vec3(-1.0, 0.0, 0.0), glm::vec3(0.0, -1.0, 0.0));// left direction
 
-			
-			shader.setMat4("modelMat", _modelMatrixCube2);
-			shader.setVec3("diffuseColour", 0.0f, 0.0f, 0.0f);
-			// Set emissive colour component for cubes 2 to be bright so it looks like a light
-			shader.setVec3("emissiveColour", 1.0f, 1.0f, 1.0f );
-				_cubeModel.Draw( );
-		
+	light.shadowTransforms[2] = shadowProj *
+		glm::lookAt(lightPos, lightPos + glm::vec3(0.0, 1.0, 0.0), glm::vec3(0.0, 0.0, 1.0));	// top direction
 
+	light.shadowTransforms[3] = shadowProj *
+		glm::lookAt(lightPos, lightPos + glm::vec3(0.0, -1.0, 0.0), glm::vec3(0.0, 0.0, -1.0));	// bottom direction
 
-		/* Draw Cube 3 */
+	light.shadowTransforms[4] = shadowProj *
+		glm::lookAt(lightPos, lightPos + glm::vec3(0.0, 0.0, 1.0), glm::vec3(0.0, -1.0, 0.0));	// near
 
-			// Set emissive colour component for cubes 3 to be dark
-			shader.setVec3("emissiveColour", 0.0f, 0.0f, 0.0f );
-			shader.setMat4("modelMat", _modelMatrixCube3);
-			// Set diffuse colour for cube 3
-			shader.setVec3("diffuseColour", 0.3f, 0.3f, 1.0f );
-				_cubeModel.Draw( );
+	light.shadowTransforms[5] = shadowProj *
+		glm::lookAt(lightPos, lightPos + glm::vec3(0.0, 0.0, -1.0), glm::vec3(0.0, -1.0, 0.0));	// far
 
+	//Pull the frustum planes out of each face matrix, they are sums and differences of its rows
+	for (int face = 0; face < 6; face++)
+	{
+		glm::mat4 transposed = glm::transpose(light.shadowTransforms[face]);
+		for (int axis = 0; axis < 3; axis++)
+		{
+			light.facePlanes[face][axis * 2] = transposed[3] + transposed[axis];
+			light.facePlanes[face][axis * 2 + 1] = transposed[3] - transposed[axis];
+		}
+		for (int plane = 0; plane < 6; plane++)
+		{
+			light.facePlanes[face][plane] /= glm::length(glm::vec3(light.facePlanes[face][plane]));
+		}
+	}
+}
+
+bool Scene::UpdateShadowTiles(ShadowAtlas& shadowAtlas)
+{
+	//Closest lights to the camera go first
+	glm::vec3 cameraPos = glm::vec3(glm::inverse(_viewMatrix)[3]);
+	std::vector<std::pair<float, unsigned int> > lightOrder;
+	for (unsigned int light = 0; light < _numLights; light++)
+	{
+		lightOrder.push_back(std::make_pair(glm::length(_pointLights[light].position - cameraPos), light));
+	}
+	std::sort(lightOrder.begin(), lightOrder.end());
+
+	//Halve the tile for every doubling of distance past _shadowTileDistance
+	std::vector<int> tileSizes(lightOrder.size());
+	long long atlasArea = 0;
+	for (unsigned int i = 0; i < lightOrder.size(); i++)
+	{
+		tileSizes[i] = MAX_SHADOW_TILE_SIZE;
+		for (float distance = lightOrder[i].first; distance > _shadowTileDistance && tileSizes[i] > shadowAtlas.GetMinTileSize(); distance *= 0.5f)
+		{
+			tileSizes[i] /= 2;
+		}
+		atlasArea += 6 * (long long)tileSizes[i] * tileSizes[i];
+	}
+
+	//Then shrink the farthest of the biggest tiles until every face fits in the atlas
+	//Sizes never grow with distance, so handing them out in this order packs the quadtree without gaps
+	long long budget = (long long)shadowAtlas.GetSize() * shadowAtlas.GetSize();
+	while (atlasArea > budget)
+	{
+		int largest = -1;
+		for (unsigned int i = 0; i < tileSizes.size(); i++)
+		{
+			if (tileSizes[i] > shadowAtlas.GetMinTileSize() && (largest < 0 || tileSizes[i] >= tileSizes[largest]))
+			{
+				largest = i;
+			}
+		}
+		if (largest < 0)
+		{
+			break;
+		}
+
+		atlasArea -= 6 * (long long)tileSizes[largest] * tileSizes[largest] * 3 / 4;
+		tileSizes[largest] /= 2;
+	}
+
+	bool moved = false;
+	for (unsigned int i = 0; i < lightOrder.size(); i++)
+	{
+		int tileSize = tileSizes[i];
+
+		//Each face is its own tile, keyed by its layer in the face masks
+		PointLight& light = _pointLights[lightOrder[i].second];
+		for (int face = 0; face < 6; face++)
+		{
+			int tile = shadowAtlas.AcquireTile(lightOrder[i].second * 6 + face, tileSize);
+			light.atlasTiles[face] = tile;
+			glm::vec4 shadowTile = tile >= 0 ? shadowAtlas.GetTileScaleOffset(tile) : glm::vec4(0.0f);
+			if (shadowTile != light.shadowTiles[face])
+			{
+				//The new tile has nothing in it yet, the face goes unshadowed until it is drawn
+				light.shadowTiles[face] = shadowTile;
+				light.validFaces &= ~(1u << face);
+				light.pendingFaces |= 1u << face;
+				moved = true;
+			}
+		}
+	}
+
+	return moved;
+}
+
+bool Scene::UpdateObjectLists()
+{
+	unsigned int numObjects = _objects.GetNumObjects();
+	bool staticChanged = _objects.GetStaticVersion() != _staticVersion;
+	if (!staticChanged && _staticObjects.size() + _dynamicObjects.size() == numObjects)
+	{
+		return false;
+	}
+
+	//A static object moving puts every light's static copies out of date, even the lights that are off at the moment
+	if (staticChanged)
+	{
+		_staticVersion = _objects.GetStaticVersion();
+		for (unsigned int light = 0; light < MAX_POINT_LIGHTS; light++)
+		{
+			_pointLights[light].pendingStaticFaces = 0x3f;
+			_pointLights[light].pendingFaces = 0x3f;
+		}
+	}
+
+	_staticObjects.clear();
+	_dynamicObjects.clear();
+	for (unsigned int object = 0; object < numObjects; object++)
+	{
+		if (_objects.IsStatic(object))
+		{
+			_staticObjects.push_back(object);
+		}
+		else
+		{
+			_dynamicObjects.push_back(object);
+		}
+	}
+	_staticBoundsDirty = true;
+
+	//Every object's faces are found again, and the active lights redraw every face for the new objects
+	std::vector<unsigned int> lights;
+	for (unsigned int light = 0; light < _numLights; light++)
+	{
+		lights.push_back(light);
+		_pointLights[light].pendingFaces = 0x3f;
+	}
+	_objectFaces.assign(numObjects * ObjectTable::LAYER_MASK_WORDS, 0);
+	for (unsigned int object = 0; object < numObjects; object++)
+	{
+		FindObjectFaces(object, lights);
+	}
+	_movedObjects.clear();
+	return true;
+}
+
+void Scene::FindObjectFaces(unsigned int object, const std::vector<unsigned int>& lights)
+{
+	//Every object is a cube, so its bounding sphere is the half diagonal of the unit cube scaled by the largest axis scale
+	const glm::mat4& modelMat = _objects.GetTransform(object);
+	glm::vec3 centre = glm::vec3(modelMat[3]);
+	float scale = glm::max(glm::length(glm::vec3(modelMat[0])), glm::max(glm::length(glm::vec3(modelMat[1])), glm::length(glm::vec3(modelMat[2]))));
+	float radius = 0.866025404f * scale;
+
+	//Light i's faces are layers i * 6 to i * 6 + 5, the same numbering as the atlas tile keys
+	unsigned int* faces = &_objectFaces[object * ObjectTable::LAYER_MASK_WORDS];
+	for (unsigned int i = 0; i < lights.size(); i++)
+	{
+		for (int face = 0; face < 6; face++)
+		{
+			const glm::vec4* planes = _pointLights[lights[i]].facePlanes[face];
+			bool inside = true;
+			for (int plane = 0; plane < 6 && inside; plane++)
+			{
+				inside = glm::dot(glm::vec3(planes[plane]), centre) + planes[plane].w >= -radius;
+			}
+
+			unsigned int layer = lights[i] * 6 + face;
+			if (inside)
+			{
+				faces[layer / 32] |= 1u << (layer % 32);
+			}
+			else
+			{
+				faces[layer / 32] &= ~(1u << (layer % 32));
+			}
+		}
+	}
+}
+
+void Scene::UpdatePendingFaces(bool facesFound)
+{
+	//A light that was off missed whatever moved in the meantime, and a light being rebuilt redraws every face
+	std::vector<unsigned int> activeLights, turnedOn;
+	for (unsigned int light = 0; light < _numLights; light++)
+	{
+		activeLights.push_back(light);
+		if (light >= _previousNumLights)
+		{
+			turnedOn.push_back(light);
+		}
+		if (light >= _previousNumLights || _pointLights[light].shadowDirty)
+		{
+			_pointLights[light].pendingFaces = 0x3f;
+		}
+	}
+	_previousNumLights = _numLights;
+
+	//Nothing kept the faces of a light that was off up to date
+	const unsigned int words = ObjectTable::LAYER_MASK_WORDS;
+	if (!facesFound && !turnedOn.empty())
+	{
+		for (unsigned int object = 0; object < _objects.GetNumObjects(); object++)
+		{
+			FindObjectFaces(object, turnedOn);
+		}
+	}
+
+	//A moving object dirties the faces it was in and the faces it is in now, nothing else has to be redrawn for it
+	for (unsigned int i = 0; i < _movedObjects.size(); i++)
+	{
+		unsigned int object = _movedObjects[i];
+		unsigned int previousFaces[ObjectTable::LAYER_MASK_WORDS];
+		memcpy(previousFaces, &_objectFaces[object * words], sizeof(previousFaces));
+		FindObjectFaces(object, activeLights);
+
+		for (unsigned int layer = 0; layer < _numLights * 6; layer++)
+		{
+			unsigned int bit = 1u << (layer % 32);
+			PointLight& light = _pointLights[layer / 6];
+			if (((_objectFaces[object * words + layer / 32] | previousFaces[layer / 32]) & bit) && light.atlasTiles[layer % 6] >= 0)
+			{
+				light.pendingFaces |= 1u << (layer % 6);
+			}
+		}
+	}
+	_movedObjects.clear();
+}
+
+void Scene::ScheduleShadowUpdates(ShadowAtlas& shadowAtlas)
+{
+	//The face budget, cut down to what the time budget buys at the cost per face measured so far
+	unsigned int budget = _maxShadowFaces;
+	if (_maxShadowMs > 0.0f && _msPerFace > 0.0f)
+	{
+		budget = glm::min(budget, (unsigned int)glm::max(_maxShadowMs / _msPerFace, 1.0f));
+	}
+
+	glm::vec3 sceneSize = _sceneBoundsMax - _sceneBoundsMin;
+	float sceneRadius = 0.5f * glm::length(sceneSize);
+
+	std::vector<ShadowUpdate> updates;
+	_staticTiles.clear();
+	for (unsigned int i = 0; i < _numLights; i++)
+	{
+		PointLight& light = _pointLights[i];
+		light.dirtyFaces = 0;
+		light.staticFaces = 0;
+		if (light.pendingFaces == 0)
+		{
+			continue;
+		}
+
+		//Screen coverage is how much of the view the scene around the light fills, halved for lights behind the camera
+		//Nearer and brighter lights matter more on top of that
+		glm::vec3 viewPos = glm::vec3(_viewMatrix * glm::vec4(light.position, 1.0f));
+		float distance = glm::length(viewPos);
+		float coverage = glm::min((sceneRadius * sceneRadius) / glm::max(distance * distance, 0.0001f), 1.0f);
+		if (viewPos.z > 0.0f)
+		{
+			coverage *= 0.5f;
+		}
+		float brightness = glm::dot(light.colour, glm::vec3(0.2126f, 0.7152f, 0.0722f));
+		float importance = coverage * brightness / (1.0f + distance / _shadowTileDistance);
+
+		//Motion goes on top, a light that moved comes before objects that moved, and a face with no shadow at all before one with a stale shadow
+		//Anything that keeps missing out climbs the longer it waits
+		if (light.shadowDirty)
+		{
+			unsigned int waited = 0;
+			for (int face = 0; face < 6; face++)
+			{
+				waited = glm::max(waited, light.pendingFrames[face]);
+			}
+			ShadowUpdate update = { importance * 4.0f * (float)(1 + waited), i, -1 };
+			updates.push_back(update);
+			continue;
+		}
+
+		for (int face = 0; face < 6; face++)
+		{
+			if ((light.pendingFaces & (1u << face)) && light.atlasTiles[face] >= 0)
+			{
+				float weight = (light.validFaces & (1u << face)) ? 1.0f : 8.0f;
+				ShadowUpdate update = { importance * weight * (float)(1 + light.pendingFrames[face]), i, face };
+				updates.push_back(update);
+			}
+		}
+	}
+	std::sort(updates.begin(), updates.end());
+
+	unsigned int used = 0;
+	for (unsigned int i = 0; i < updates.size() && used < budget; i++)
+	{
+		PointLight& light = _pointLights[updates[i].light];
+
+		//A whole light costs a face for every tile it has
+		unsigned int cost = 1;
+		if (updates[i].face < 0)
+		{
+			cost = 0;
+			for (int face = 0; face < 6; face++)
+			{
+				cost += light.atlasTiles[face] >= 0 ? 1 : 0;
+			}
+		}
+
+		//The first update always goes ahead, so a light bigger than the budget still gets its turn
+		if (used > 0 && used + cost > budget)
+		{
+			continue;
+		}
+		used += cost;
+
+		if (updates[i].face < 0)
+		{
+			BuildShadowTransforms(light);
+			_rebuiltLights.push_back(updates[i].light);
+			_lightDataDirty = true;
+			for (int face = 0; face < 6; face++)
+			{
+				if (light.atlasTiles[face] >= 0)
+				{
+					ScheduleFace(light, face, shadowAtlas);
+				}
+			}
+		}
+		else
+		{
+			ScheduleFace(light, updates[i].face, shadowAtlas);
+		}
+	}
+
+	//Whatever didn't fit waits for the next frame, and gets more important for it
+	_numDirtyFaces = 0;
+	_numPendingFaces = 0;
+	for (unsigned int light = 0; light < _numLights; light++)
+	{
+		for (int face = 0; face < 6; face++)
+		{
+			if (_pointLights[light].dirtyFaces & (1u << face))
+			{
+				_numDirtyFaces++;
+			}
+			if (_pointLights[light].pendingFaces & (1u << face))
+			{
+				_pointLights[light].pendingFrames[face]++;
+				_numPendingFaces++;
+			}
+		}
+	}
+	_averageFacesDrawn = 0.9f * _averageFacesDrawn + 0.1f * (float)_numDirtyFaces;
+}
+
+void Scene::ScheduleFace(PointLight& light, int face, ShadowAtlas& shadowAtlas)
+{
+	unsigned int bit = 1u << face;
+	int tile = light.atlasTiles[face];
+
+	//The depth pass redraws it this frame, so it counts as cached from here on
+	if ((light.pendingStaticFaces & bit) || !shadowAtlas.IsStaticCached(tile))
+	{
+		shadowAtlas.SetStaticCached(tile, true);
+		light.staticFaces |= bit;
+		_staticTiles.push_back(tile);
+	}
+	light.pendingStaticFaces &= ~bit;
+	light.pendingFaces &= ~bit;
+	light.pendingFrames[face] = 0;
+	light.dirtyFaces |= bit;
+
+	//The shaders can use the tile from this frame on
+	if (!(light.validFaces & bit))
+	{
+		light.validFaces |= bit;
+		_lightDataDirty = true;
+	}
+}
+
+void Scene::UpdateFaceMasks()
+{
+	//The lights the scheduler rebuilt have new planes, so every object's faces are found again for them
+	if (!_rebuiltLights.empty())
+	{
+		for (unsigned int object = 0; object < _objects.GetNumObjects(); object++)
+		{
+			FindObjectFaces(object, _rebuiltLights);
+		}
+		_rebuiltLights.clear();
+	}
+
+	//The layers being redrawn this frame, and the ones whose static copy is
+	unsigned int dirtyLayers[ObjectTable::LAYER_MASK_WORDS] = { 0 };
+	unsigned int staticLayers[ObjectTable::LAYER_MASK_WORDS] = { 0 };
+	bool anyStatic = false;
+	for (unsigned int layer = 0; layer < _numLights * 6; layer++)
+	{
+		const PointLight& light = _pointLights[layer / 6];
+		unsigned int faceBit = 1u << (layer % 6);
+		if (light.dirtyFaces & faceBit)
+		{
+			dirtyLayers[layer / 32] |= 1u << (layer % 32);
+		}
+		if (light.staticFaces & faceBit)
+		{
+			staticLayers[layer / 32] |= 1u << (layer % 32);
+			anyStatic = true;
+		}
+	}
+
+	//Last frame's objects first, so the ones not drawn this frame are cleared
+	for (unsigned int i = 0; i < _maskedObjects.size(); i++)
+	{
+		unsigned int object = _maskedObjects[i];
+		SetFaceMask(object, _objects.IsStatic(object) ? staticLayers : dirtyLayers);
+	}
+
+	//Only send each object to the faces that are being redrawn
+	_maskedObjects.clear();
+	_numShadowFaces = 0;
+	for (unsigned int i = 0; i < _dynamicObjects.size(); i++)
+	{
+		unsigned int numFaces = SetFaceMask(_dynamicObjects[i], dirtyLayers);
+		if (numFaces > 0)
+		{
+			_maskedObjects.push_back(_dynamicObjects[i]);
+			_numShadowFaces += numFaces;
+		}
+	}
+	for (unsigned int i = 0; i < _staticObjects.size() && anyStatic; i++)
+	{
+		unsigned int numFaces = SetFaceMask(_staticObjects[i], staticLayers);
+		if (numFaces > 0)
+		{
+			_maskedObjects.push_back(_staticObjects[i]);
+			_numShadowFaces += numFaces;
+		}
+	}
+}
+
+unsigned int Scene::SetFaceMask(unsigned int object, const unsigned int* layers)
+{
+	const unsigned int* faces = &_objectFaces[object * ObjectTable::LAYER_MASK_WORDS];
+	unsigned int layerMask[ObjectTable::LAYER_MASK_WORDS];
+	unsigned int numFaces = 0;
+	for (unsigned int word = 0; word < ObjectTable::LAYER_MASK_WORDS; word++)
+	{
+		layerMask[word] = faces[word] & layers[word];
+		for (unsigned int bits = layerMask[word]; bits != 0; bits &= bits - 1)
+		{
+			numFaces++;
+		}
+	}
+
+	_objects.SetLayerMask(object, layerMask);
+	return numFaces;
+}
+
+void Scene::UpdateUniformBuffers(ShadowAtlas& shadowAtlas)
+{
+	bool facesFound = UpdateObjectLists();
+	UpdateShadowTransforms();
+
+	if (UpdateShadowTiles(shadowAtlas))
+	{
+		_lightDataDirty = true;
+	}
+
+	//Objects go up here rather than in Update, their face masks need this frame's shadow transforms
+	UpdatePendingFaces(facesFound);
+	ScheduleShadowUpdates(shadowAtlas);
+	UpdateFaceMasks();
+	_objects.Upload();
+
+	//Camera data
+	FrameUniformData frameData;
+	frameData.viewMat = _viewMatrix;
+	frameData.projMat = _projMatrix;
+	// We use the small cube's model matrix to transform the light position
+	// This means the light will have the position of the small cube
+	frameData.worldSpaceLightPos = _modelMatrixCube2 * glm::vec4(0, 0, 0, 1);
+	memcpy(&_uniformStaging[0], &frameData, sizeof(frameData));
+
+	glBindBuffer(GL_UNIFORM_BUFFER, _uniformBuffer);
+
+	if (_lightDataDirty)
+	{
+		//Light data, every light's six cube-face matrices and tiles go up together with the rest of the block
+		//The tiles of faces that haven't been drawn yet go up as no tile
+		LightUniformData& lightData = *(LightUniformData*)&_uniformStaging[_lightBlockOffset];
+		lightData.lightSpaceMatrix = lightSpaceMatrix;
+		lightData.nearPlane = near_plane;
+		lightData.farPlane = far_plane;
+		lightData.numLights = (int)_numLights;
+		for (unsigned int light = 0; light < _numLights; light++)
+		{
+			for (int i = 0; i < 6; i++)
+			{
+				lightData.lights[light].shadowMatrices[i] = _pointLights[light].shadowTransforms[i];
+				lightData.lights[light].shadowTiles[i] = (_pointLights[light].validFaces & (1u << i)) ? _pointLights[light].shadowTiles[i] : glm::vec4(0.0f);
+			}
+			lightData.lights[light].position = glm::vec4(_pointLights[light].shadowPosition, _pointLights[light].farPlane);
+			lightData.lights[light].colour = glm::vec4(_pointLights[light].colour, 1.0f);
+		}
+
+		//One upload covers both blocks, up to the last light in use
+		glBufferSubData(GL_UNIFORM_BUFFER, 0, _lightBlockOffset + sizeof(LightUniformData) - sizeof(PointLightUniformData) * (MAX_POINT_LIGHTS - _numLights), &_uniformStaging[0]);
+		_lightDataDirty = false;
+	}
+	else
+	{
+		//Steady state, the light block is already on the GPU so only the camera data goes up
+		glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(FrameUniformData), &_uniformStaging[0]);
+	}
+
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+
+	glBindBufferRange(GL_UNIFORM_BUFFER, FRAME_UBO_BINDING, _uniformBuffer, 0, sizeof(FrameUniformData));
+	glBindBufferRange(GL_UNIFORM_BUFFER, LIGHT_UBO_BINDING, _uniformBuffer, _lightBlockOffset, sizeof(LightUniformData));
+}
+
+const Scene::ShaderUniforms& Scene::GetShaderUniforms(const Shader& shader)
+{
+	std::unordered_map<unsigned int, ShaderUniforms>::iterator it = _shaderUniforms.find(shader.getRevision());
+	if (it != _shaderUniforms.end())
+	{
+		return it->second;
+	}
+
+	ShaderUniforms& uniforms = _shaderUniforms[shader.getRevision()];
+	uniforms.shadowAtlas = shader.getUniform<int>("shadowAtlas");
+	uniforms.momentsMap = shader.getUniform<int>("momentsMap");
+	uniforms.lightIndex = shader.getUniform<int>("lightIndex");
+	return uniforms;
+}
+
+void Scene::Draw(Shader& shader)
+{
+	// Activate the shader program
+	//glUseProgram( _shaderProgram );
+
+	//Use the program ID with my shader class
+	shader.use();
+
+	//Uniform locations were looked up once, so this is just glUniform calls
+	//Camera and light data come from the uniform buffer set up in UpdateUniformBuffers
+	const ShaderUniforms& uniforms = GetShaderUniforms(shader);
+	uniforms.shadowAtlas.set(0);
+	uniforms.momentsMap.set(1);
+
+	/* Draw every cube */
+
+	// Transforms and materials come from the object table, uploaded in UpdateUniformBuffers
+	_objects.Draw( );
 
 	// Technically we can do this, but it makes no real sense because we must always have a valid shader program to draw geometry
 	glUseProgram( 0 );
 }
 
+void Scene::DrawShadowCasters(Shader& shader, bool layered, ShadowAtlas& shadowAtlas)
+{
+	shader.use();
 
+	//The shaders squeeze each face into its tile, these clip away whatever falls outside it
+	for (int i = 0; i < 4; i++)
+	{
+		glEnable(GL_CLIP_DISTANCE0 + i);
+	}
 
+	//Redraw the static copies that are out of date, the face masks only send the static objects to those
+	if (!_staticTiles.empty())
+	{
+		glBindFramebuffer(GL_FRAMEBUFFER, shadowAtlas.GetStaticFramebuffer());
+		glEnable(GL_SCISSOR_TEST);
+		for (unsigned int i = 0; i < _staticTiles.size(); i++)
+		{
+			int tile = _staticTiles[i];
+			glScissor(shadowAtlas.GetTileX(tile), shadowAtlas.GetTileY(tile), shadowAtlas.GetTileSize(tile), shadowAtlas.GetTileSize(tile));
+			glClear(GL_DEPTH_BUFFER_BIT);
+		}
+		glDisable(GL_SCISSOR_TEST);
+
+		DrawShadowCasterObjects(shader, layered, ObjectTable::DRAW_STATIC);
+	}
+
+	//Copying the static copy in takes the place of clearing a dirty tile, then only the moving objects are drawn
+	//Clean tiles are left alone, their depth from last frame still holds
+	for (unsigned int light = 0; light < _numLights; light++)
+	{
+		for (int face = 0; face < 6; face++)
+		{
+			if (_pointLights[light].atlasTiles[face] >= 0 && (_pointLights[light].dirtyFaces & (1u << face)))
+			{
+				shadowAtlas.CopyStaticTile(_pointLights[light].atlasTiles[face]);
+			}
+		}
+	}
+
+	glBindFramebuffer(GL_FRAMEBUFFER, shadowAtlas.GetFramebuffer());
+	DrawShadowCasterObjects(shader, layered, ObjectTable::DRAW_DYNAMIC);
+
+	for (int i = 0; i < 4; i++)
+	{
+		glDisable(GL_CLIP_DISTANCE0 + i);
+	}
+
+	glUseProgram( 0 );
+}
+
+void Scene::DrawDynamicShadowCasters(Shader& shader, bool layered)
+{
+	shader.use();
+
+	for (int i = 0; i < 4; i++)
+	{
+		glEnable(GL_CLIP_DISTANCE0 + i);
+	}
+
+	DrawShadowCasterObjects(shader, layered, ObjectTable::DRAW_DYNAMIC);
+
+	for (int i = 0; i < 4; i++)
+	{
+		glDisable(GL_CLIP_DISTANCE0 + i);
+	}
+
+	glUseProgram( 0 );
+}
+
+void Scene::SetShadowVariant(const ShadowVariant& variant)
+{
+	//The moments texture isn't kept up to date while PCF is in use, so it all has to be filtered again
+	if (variant.technique != _shadowVariant.technique)
+	{
+		_momentsDirty = true;
+	}
+	_shadowVariant = variant;
+
+	//The gathers cover the kernel two texels at a time, so it has to be odd
+	_shadowVariant.kernelSize = glm::clamp(variant.kernelSize | 1, 3, 7);
+}
+
+void Scene::FilterShadowMoments(ShadowMoments& shadowMoments, ShadowAtlas& shadowAtlas)
+{
+	if (_shadowVariant.technique != ShadowVariant::TECHNIQUE_EVSM)
+	{
+		return;
+	}
+
+	//Only the tiles holding a finished shadow are worth filtering, the rest are sent to the shaders without a tile
+	bool filtered = false;
+	for (unsigned int light = 0; light < _numLights; light++)
+	{
+		const PointLight& pointLight = _pointLights[light];
+		unsigned int faces = pointLight.validFaces & (_momentsDirty ? 0x3fu : pointLight.dirtyFaces);
+		for (int face = 0; face < 6; face++)
+		{
+			int tile = pointLight.atlasTiles[face];
+			if (tile >= 0 && (faces & (1u << face)))
+			{
+				shadowMoments.FilterTile(shadowAtlas.GetTexture(), shadowAtlas.GetTileX(tile), shadowAtlas.GetTileY(tile), shadowAtlas.GetTileSize(tile),
+					pointLight.nearPlane / pointLight.farPlane);
+				filtered = true;
+			}
+		}
+	}
+	_momentsDirty = false;
+
+	if (filtered)
+	{
+		shadowMoments.GenerateMipmaps();
+	}
+}
+
+void Scene::DrawShadowCasterObjects(Shader& shader, bool layered, ObjectTable::DrawFilter filter)
+{
+	if (layered)
+	{
+		//Every object carries its own list of layers, one per face tile, so one draw covers all the lights
+		_objects.Draw(true, filter, true);
+	}
+	else
+	{
+		//The geometry shader sends each triangle to the faces of one light, so go round the lights
+		const ShaderUniforms& uniforms = GetShaderUniforms(shader);
+		for (unsigned int light = 0; light < _numLights; light++)
+		{
+			//Skip the lights with nothing to redraw
+			unsigned int redrawn = filter == ObjectTable::DRAW_STATIC ? _pointLights[light].staticFaces : _pointLights[light].dirtyFaces;
+			if (redrawn == 0)
+			{
+				continue;
+			}
+
+			uniforms.lightIndex.set((int)light);
+			_objects.Draw(false, filter, true);
+		}
+	}
+}
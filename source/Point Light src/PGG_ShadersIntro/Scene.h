@@ -1,6 +1,10 @@
 #define glCheckError() glCheckError_(__FILE__, __LINE__) 
 
 #include "Cube.h"
+#include "ObjectTable.h"
+#include "ShadowAtlas.h"
+#include "ShadowMoments.h"
+#include "ShadowVariant.h"
 
 
 // The GLM library contains vector and matrix functions and classes for us to use
@@ -9,10 +13,11 @@
 #include <GLM/gtc/matrix_transform.hpp> // This one lets us use matrix transformations
 #include <GLM/gtc/type_ptr.hpp> // This one gives us access to a utility function which makes sending data to OpenGL nice and easy
 #include <iostream>
+#include <unordered_map>
 #include <vector>
 
+#include "Shader.h"
 
-class Shader;
 class Scene
 {
 public:
@@ -25,8 +30,57 @@ public:
 
 	void Update(float deltaTs);
 
+	// Uploads the camera and light data shared by every shader program, and this frame's objects
+	// Every active light's cube faces get a tile in the shadow atlas here
+	// Call this once per frame after ShadowAtlas::BeginFrame, before any of the Draw passes
+	void UpdateUniformBuffers(ShadowAtlas& shadowAtlas);
 
-	void Draw(Shader shader, int SHADOW_WIDTH, int SHADOW_HEIGHT = 640);
+	void Draw(Shader& shader);
+
+	// Renders the shadow casters into the light's cube face tiles in the shadow atlas that are dirty, the rest keep last frame's depth
+	// Static objects are only drawn into static copies that are out of date, each dirty tile starts from its static copy and the moving objects go on top
+	// The layered path does all the lights in one pass, the geometry shader path does one pass per light
+	void DrawShadowCasters(Shader& shader, bool layered, ShadowAtlas& shadowAtlas);
+
+	// Draws only the moving casters into the faces being redrawn this frame, into whatever framebuffer is bound
+	// This is for timing a depth pass path away from the atlas, it leaves the shadows alone
+	void DrawDynamicShadowCasters(Shader& shader, bool layered);
+
+	// Which compile-time variant of the lit shader's shadow lookup to draw with, Draw must be given a program built for it
+	void SetShadowVariant(const ShadowVariant& variant);
+	const ShadowVariant& GetShadowVariant() const { return _shadowVariant; }
+
+	// Filters the cube face tiles redrawn this frame into the moments texture, does nothing unless the variant is EVSM
+	// Call this after DrawShadowCasters
+	void FilterShadowMoments(ShadowMoments& shadowMoments, ShadowAtlas& shadowAtlas);
+
+	// Number of cube faces the objects were sent to by the last UpdateUniformBuffers, out of six per object per light
+	unsigned int GetNumShadowFaces() const { return _numShadowFaces; }
+
+	// Number of cube face tiles the last UpdateUniformBuffers scheduled for redrawing, and the number still waiting for their turn
+	unsigned int GetNumDirtyFaces() const { return _numDirtyFaces; }
+	unsigned int GetNumPendingFaces() const { return _numPendingFaces; }
+	unsigned int GetNumObjects() const { return _objects.GetNumObjects(); }
+
+	// Triangles a pass that draws every object submits, all the objects share the cube mesh
+	unsigned int GetNumObjectTriangles() const { return _objects.GetNumObjects() * (_cubeModel.GetNumVertices() / 3); }
+
+	// Adds a grid of count small static cubes over the floor, to check how the passes cope with a large number of objects
+	void AddCubeField(unsigned int count);
+
+	// Limits the shadow updates of a frame to at most maxFaces cube faces, and roughly maxMs of depth pass time if maxMs is above zero
+	// Whatever doesn't fit waits for a later frame, the most important lights going first
+	void SetShadowUpdateBudget(unsigned int maxFaces, float maxMs);
+
+	// GPU time of the latest depth pass, this is what the time budget is measured against
+	void SetDepthPassTime(float ms);
+
+	// Maximum number of shadowed point lights, this must match MAX_POINT_LIGHTS in uniformBlocks.txt
+	enum { MAX_POINT_LIGHTS = 32 };
+
+	// The first numLights of the scene's point lights are lit and cast shadows
+	void SetNumLights(unsigned int numLights);
+	unsigned int GetNumLights() const { return _numLights; }
 
 
 protected:
@@ -39,6 +93,13 @@ protected:
 	glm::mat4 _modelMatrixCube2;
 	glm::mat4 _modelMatrixCube3;
 
+	// Every object in the scene, the cubes' transforms are written to it once per frame
+	ObjectTable _objects;
+	unsigned int _cube1Object, _cube2Object, _cube3Object;
+
+	// Writes a cube's transform to the object table, a cube the table had no room for is INVALID_ID and is skipped
+	void SetCubeTransform(unsigned int object, const glm::mat4& modelMat);
+
 	// All cubes share the same viewing matrix - this defines the camera's orientation and position
 	glm::mat4 _viewMatrix;
 
@@ -59,11 +120,133 @@ protected:
 	glm::mat4 lightSpaceMatrix;
 	
 
-	//Shadow projection
-	glm::mat4 shadowProj;
+	//A shadowed point light, each of its cube faces renders into its own tile of the shadow atlas
+	struct PointLight
+	{
+		glm::vec3 position;
+		glm::vec3 colour;
+
+		//The shadow directions for the depth map, one per cube face.
+		glm::mat4 shadowTransforms[6];
+
+		//Planes of the cube-face projection, fitted to the scene bounds so the depth range only covers real geometry
+		//The tiles hold the perspective depth between them, the far plane is also what the EVSM distances are divided by
+		float nearPlane, farPlane;
+
+		//Where each face's tile is in the atlas, as the scale and offset ShadowAtlas::GetTileScaleOffset gives. A face with no tile has zero scale.
+		//atlasTiles is the tile itself, -1 for none
+		glm::vec4 shadowTiles[6];
+		int atlasTiles[6];
+
+		//The rest are a bit for each face
+		//pendingFaces need their tile redrawing, because the light changed, the tile moved or a moving object entered or left the face
+		//pendingStaticFaces need their static copy redrawing as well. Both wait there until the scheduler gets to them.
+		unsigned int pendingFaces;
+		unsigned int pendingStaticFaces;
+		unsigned int pendingFrames[6];
+
+		//The faces the scheduler picked this frame, dirtyFaces get their tile redrawn and staticFaces their static copy too
+		unsigned int dirtyFaces;
+		unsigned int staticFaces;
+
+		//Faces whose tile holds a finished shadow, the rest are sent to the shaders without a tile so they are lit unshadowed
+		unsigned int validFaces;
+
+		//Frustum planes of each cube face, taken from shadowTransforms. Each plane is (normal, distance) with the normal pointing inwards.
+		glm::vec4 facePlanes[6][6];
+
+		//The position the shadow transforms were last built from, and whether they need building at all. The planes are also only changed when building.
+		//The shaders light from shadowPosition too, so a light waiting for its shadows to be rebuilt doesn't get ahead of them.
+		glm::vec3 shadowPosition;
+		bool shadowDirty;
+	};
 
-	//Vector to store the shadow directions for the depth map.
-	std::vector<glm::mat4> shadowTransforms;
+	//Every light the scene has, only the first _numLights are used
+	std::vector<PointLight> _pointLights;
+	unsigned int _numLights;
+	unsigned int _numShadowFaces;
+	unsigned int _numDirtyFaces;
+	unsigned int _numPendingFaces;
+
+	//Box around every object, rounded out to a grid so small movements don't change it
+	//The shadow projections are fitted to it, and only refitted when it changes
+	//The static objects' part of it is kept, and only found again when the object lists change
+	glm::vec3 _sceneBoundsMin, _sceneBoundsMax;
+	glm::vec3 _staticBoundsMin, _staticBoundsMax;
+	bool _staticBoundsDirty;
+	bool UpdateSceneBounds();
+
+	//Fits lightProjection and its near and far planes to the scene bounds
+	void FitLightProjection();
+
+	//The shadow transforms are only rebuilt, and the light block only re-uploaded, when the scene bounds or a light changes.
+	bool _lightDataDirty;
+
+	//Flags each light whose planes and shadowTransforms are out of date because it or the scene bounds changed, the scheduler rebuilds them
+	void UpdateShadowTransforms();
+	void BuildShadowTransforms(PointLight& light);
+
+	//Largest cube face tile, lights get half the size for every doubling of their distance from the camera past _shadowTileDistance
+	enum { MAX_SHADOW_TILE_SIZE = 512 };
+	float _shadowTileDistance;
+
+	//Acquires every active light's face tiles, nearest lights first so they get the space when the atlas is full. Returns true if any tile moved.
+	bool UpdateShadowTiles(ShadowAtlas& shadowAtlas);
+
+	//Sorts the objects into static and dynamic when objects are added or the static version changes, and finds all their faces again
+	//Returns true if it did, a static change puts every light's static copies out of date and new objects put every active light's faces
+	bool UpdateObjectLists();
+	std::vector<unsigned int> _staticObjects, _dynamicObjects;
+	unsigned int _staticVersion;
+
+	//Which cube faces of which active light each object's bounding sphere touches, LAYER_MASK_WORDS words per object
+	//Kept from frame to frame, FindObjectFaces only sets the bits of the lights it is given
+	std::vector<unsigned int> _objectFaces;
+	void FindObjectFaces(unsigned int object, const std::vector<unsigned int>& lights);
+
+	//Adds the faces each dynamic object moved in or out of to the lights' pending faces, as does a light being turned on
+	//Only the objects SetCubeTransform saw moving have their faces found again, unless the object lists were just rebuilt
+	void UpdatePendingFaces(bool facesFound);
+	unsigned int _previousNumLights;
+	std::vector<unsigned int> _movedObjects;
+
+	//Hands this frame's budget out to the pending work, most important first, rebuilding the lights and picking the faces that are redrawn
+	//A light that needs rebuilding is done as a whole so its faces never disagree, everything else one face at a time
+	//_staticTiles are the tiles whose static copy is redrawn, cleared before the static objects are drawn into them
+	void ScheduleShadowUpdates(ShadowAtlas& shadowAtlas);
+	void ScheduleFace(PointLight& light, int face, ShadowAtlas& shadowAtlas);
+	std::vector<int> _staticTiles;
+
+	//The lights ScheduleShadowUpdates rebuilt this frame, their planes changed so UpdateFaceMasks finds their faces again
+	std::vector<unsigned int> _rebuiltLights;
+
+	//One piece of pending work, a single face or with face -1 a whole light
+	struct ShadowUpdate
+	{
+		float priority;
+		unsigned int light;
+		int face;
+		bool operator<(const ShadowUpdate& other) const { return priority > other.priority; }
+	};
+
+	//The budget from SetShadowUpdateBudget, with the depth pass time per face measured so far and the faces drawn per frame it was measured over
+	unsigned int _maxShadowFaces;
+	float _maxShadowMs;
+	float _msPerFace;
+	float _averageFacesDrawn;
+
+	//With EVSM every tile that gets redrawn is filtered again, _momentsDirty makes the next filter do every tile, as after switching to EVSM
+	ShadowVariant _shadowVariant;
+	bool _momentsDirty;
+
+	//Sends each object to the faces being redrawn this frame, static objects only to the faces whose static copy is
+	//Static objects are only looked at on frames that redraw a static copy, and the objects masked last frame are cleared
+	void UpdateFaceMasks();
+	unsigned int SetFaceMask(unsigned int object, const unsigned int* layers);
+	std::vector<unsigned int> _maskedObjects;
+
+	//Draws the objects that pass the filter into the tiles their face masks select
+	void DrawShadowCasterObjects(Shader& shader, bool layered, ObjectTable::DrawFilter filter);
 
 	// Angle of rotation for our cube
 	float _cube1Angle;
@@ -73,17 +256,54 @@ protected:
 	float aspect;
 
 
+	// Uniform buffer binding points, these must match the bindings declared in the shaders
+	enum { FRAME_UBO_BINDING = 0, LIGHT_UBO_BINDING = 1 };
+
+	// std140 mirror of the FrameData block in the shaders
+	struct FrameUniformData
+	{
+		glm::mat4 viewMat;
+		glm::mat4 projMat;
+		glm::vec4 worldSpaceLightPos;
+	};
+
+	// std140 mirror of the PointLight struct in the shaders
+	struct PointLightUniformData
+	{
+		glm::mat4 shadowMatrices[6];
+		glm::vec4 position; //w is the far plane
+		glm::vec4 colour;
+		glm::vec4 shadowTiles[6];
+	};
+
+	// std140 mirror of the LightData block in the shaders
+	struct LightUniformData
+	{
+		glm::mat4 lightSpaceMatrix;
+		float nearPlane;
+		float farPlane;
+		int numLights;
+		float padding;
+		PointLightUniformData lights[MAX_POINT_LIGHTS];
+	};
+
+	// One buffer holds both blocks so the whole frame goes up in a single glBufferSubData
+	GLuint _uniformBuffer;
+	GLintptr _lightBlockOffset;
+	GLsizeiptr _uniformBufferSize;
+	std::vector<unsigned char> _uniformStaging;
+
 	// These are for storing the Uniform locations of shader variables
 	// We need these so we can send Uniform data to them
-	GLint _shaderModelMatLocation;
-	GLint _shaderViewMatLocation;
-	GLint _shaderProjMatLocation;
-	GLint _lightSpaceMatrixLocation;
-	GLint _textureLocation;
-	GLint _nearplane;
-	GLint _farplane;
-
-	GLint _shaderDiffuseColLocation, _shaderEmissiveColLocation;
-	GLint _shaderWSLightPosLocation;
+	struct ShaderUniforms
+	{
+		Uniform<int> shadowAtlas;
+		Uniform<int> momentsMap;
+		Uniform<int> lightIndex;
+	};
+
+	// Handles are resolved the first time a program is drawn with, keyed by its revision so a reloaded program gets them again
+	std::unordered_map<unsigned int, ShaderUniforms> _shaderUniforms;
+	const ShaderUniforms& GetShaderUniforms(const Shader& shader);
 
 };
@@ -1,4 +1,7 @@
 
+#ifndef __SHADER_H__
+#define __SHADER_H__
+
 #include <GLM/glm.hpp> // This is the main GLM header
 #include <GLM/gtc/matrix_transform.hpp> // This one lets us use matrix transformations
 #include <GLM/gtc/type_ptr.hpp> // This one gives us access to a utility function which makes sending data to OpenGL nice and easy
@@ -6,287 +9,748 @@
 #include <fstream>
 #include <sstream>
 #include <iostream>
+#include <vector>
+#include <unordered_map>
+#include <iomanip>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <sys/stat.h>
 #include <SDL/SDL.h>
 #include "glew.h"
 
+// Overloads that upload a value to an already resolved uniform location
+inline void SetUniformValue(GLint location, bool value) { glUniform1i(location, (int)value); }
+inline void SetUniformValue(GLint location, int value) { glUniform1i(location, value); }
+inline void SetUniformValue(GLint location, float value) { glUniform1f(location, value); }
+inline void SetUniformValue(GLint location, const glm::ivec2& value) { glUniform2iv(location, 1, &value[0]); }
+inline void SetUniformValue(GLint location, const glm::vec2& value) { glUniform2fv(location, 1, &value[0]); }
+inline void SetUniformValue(GLint location, const glm::vec3& value) { glUniform3fv(location, 1, &value[0]); }
+inline void SetUniformValue(GLint location, const glm::vec4& value) { glUniform4fv(location, 1, &value[0]); }
+inline void SetUniformValue(GLint location, const glm::mat2& mat) { glUniformMatrix2fv(location, 1, GL_FALSE, &mat[0][0]); }
+inline void SetUniformValue(GLint location, const glm::mat3& mat) { glUniformMatrix3fv(location, 1, GL_FALSE, &mat[0][0]); }
+inline void SetUniformValue(GLint location, const glm::mat4& mat) { glUniformMatrix4fv(location, 1, GL_FALSE, glm::value_ptr(mat)); }
+
+//Typed handle to a uniform whose location was looked up once, when the program was linked.
+//Setting it is a single glUniform call with no string lookups or driver queries.
+template <typename T>
+class Uniform
+{
+public:
+	Uniform() : location(-1) {}
+	explicit Uniform(GLint location) : location(location) {}
+
+	void set(const T& value) const { SetUniformValue(location, value); }
+
+	//A location of -1 means the uniform is not active in this program, glUniform silently ignores it
+	bool valid() const { return location != -1; }
+
+	GLint location;
+};
+
 class Shader
 {
 public:
 	unsigned int id;
-	Shader(const char* vertexPath, const char* fragmentPath, const char* geometryPath = nullptr)
+
+	//Active uniform reflected from the linked program
+	struct UniformInfo
 	{
-		std::string vertexCode(vertexPath);
-		std::string fragmentCode(fragmentPath);
+		GLint location;
+		GLenum type;
+		GLint size;
+	};
 
+	//defines is put at the top of every stage's source, straight after its #version line, to compile a variant of the same files
+	//With no fragmentPath the program only writes the depth the rasterizer works out, for depth passes that don't need anything else
+	Shader(const char* vertexPath, const char* fragmentPath, const char* geometryPath = nullptr, const std::string& defines = std::string())
+	{
+		sources.vertexPath = vertexPath;
+		sources.fragmentPath = fragmentPath != nullptr ? fragmentPath : "";
+		sources.geometryPath = geometryPath != nullptr ? geometryPath : "";
+		sources.defines = defines;
+		startInitialBuild();
+	}
 
-		//Upload Vertex Shader
-		std::ifstream vertFile(vertexCode);
-		char* vShaderText = NULL;
+	//A compute program, built from the one stage, run it with use and glDispatchCompute
+	explicit Shader(const char* computePath)
+	{
+		sources.computePath = computePath;
+		startInitialBuild();
+	}
 
-		if (vertFile.is_open())
+	~Shader()
+	{
+		//A reload still being built for it is dropped by the reload thread, one that finished but wasn't swapped in is deleted here
+		ReloadWorker& worker = Worker();
+		std::lock_guard<std::mutex> lock(worker.mutex);
+		std::vector<Shader*>& shaders = Registry();
+		shaders.erase(std::remove(shaders.begin(), shaders.end(), this), shaders.end());
+		for (unsigned int i = 0; i < worker.finished.size();)
 		{
-			// Find out how many characters are in the file
-			vertFile.seekg(0, vertFile.end);
-			int length = (int)vertFile.tellg();
-			vertFile.seekg(0, vertFile.beg);
-
-			// Create our buffer
-			vShaderText = new char[length];
-
-			// Transfer data from file to buffer
-			vertFile.read(vShaderText, length);
-
-			// Check it reached the end of the file
-			if (!vertFile.eof())
+			if (worker.finished[i].shader == this)
 			{
-				vertFile.close();
-				std::cerr << "WARNING: could not read vertex shader from file: " << vertexCode << std::endl;
-				return;
+				glDeleteProgram(worker.finished[i].program);
+				worker.finished.erase(worker.finished.begin() + i);
 			}
+			else
+			{
+				i++;
+			}
+		}
+	}
 
-			// Find out how many characters were actually read
-			length = (int)vertFile.gcount();
-
-			// Needs to be NULL-terminated
-			vShaderText[length - 1] = 0;
+	//Every Shader is registered by its address for reloading, so they can't be copied
+	Shader(const Shader&) = delete;
+	Shader& operator=(const Shader&) = delete;
 
-			vertFile.close();
-		}
-		else
+	//Waits for the compile and link the constructor started, reports any errors and builds the uniform table
+	//use and the uniform lookups call this, so a program is only waited for when it is first needed
+	void finish() const
+	{
+		if (!pending)
 		{
-			std::cerr << "WARNING: could not open vertex shader from file: " << vertexCode << std::endl;
 			return;
 		}
+		pending = false;
 
-		//Upload Fragment Shader
-		std::ifstream fragFile(fragmentCode);
-		char* fShaderText = NULL;
-
-		if (fragFile.is_open())
+		if (FinishBuild(initialBuild))
 		{
-			// Find out how many characters are in the file
-			fragFile.seekg(0, fragFile.end);
-			int length = (int)fragFile.tellg();
-			fragFile.seekg(0, fragFile.beg);
-
-			// Create our buffer
-			fShaderText = new char[length];
-
-			// Transfer data from file to buffer
-			fragFile.read(fShaderText, length);
+			revision = NextRevision();
 
-			// Check it reached the end of the file
-			if (!fragFile.eof())
-			{
-				fragFile.close();
-				std::cerr << "WARNING: could not read fragment shader from file: " << fragmentCode << std::endl;
-				return;
-			}
-
-			// Find out how many characters were actually read
-			length = (int)fragFile.gcount();
+			//Build the uniform table once so the per-frame path never has to ask the driver
+			reflectUniforms();
+		}
+	}
 
-			// Needs to be NULL-terminated
-			fShaderText[length - 1] = 0;
+	//Different for every program any Shader has linked, uniform handles resolved from a Shader have to be resolved again when this changes
+	unsigned int getRevision() const
+	{
+		finish();
+		return revision;
+	}
 
-			fragFile.close();
-		}
-		else
+	//Looks for changes to the source files of every Shader, at most twice a second, and rebuilds the programs they belong to on a thread of its own
+	//The thread has a GL context sharing objects with the render context, so reading the files, the binary cache, compiling and linking never hold up a frame
+	//Call it with the render context current on window. Without it, or if there is no context for it, the source files aren't watched
+	static bool StartReloadThread(SDL_Window* window)
+	{
+		ReloadWorker& worker = Worker();
+		if (worker.thread.joinable())
 		{
-			std::cerr << "WARNING: could not open fragment shader from file: " << fragmentCode << std::endl;
-			return;
+			return true;
 		}
 
-		//Upload Geometry Shader
-		
-		char* gShaderText = NULL;
-
-		if (geometryPath != nullptr)
+		//A hidden window of its own, so the two contexts are never current on the same window
+		SDL_GLContext renderContext = SDL_GL_GetCurrentContext();
+		worker.window = SDL_CreateWindow("", 0, 0, 1, 1, SDL_WINDOW_OPENGL | SDL_WINDOW_HIDDEN);
+		SDL_GL_SetAttribute(SDL_GL_SHARE_WITH_CURRENT_CONTEXT, 1);
+		worker.context = worker.window != nullptr ? SDL_GL_CreateContext(worker.window) : nullptr;
+		SDL_GL_SetAttribute(SDL_GL_SHARE_WITH_CURRENT_CONTEXT, 0);
+		SDL_GL_MakeCurrent(window, renderContext);
+		if (worker.context == nullptr)
 		{
-			std::string geometryCode(geometryPath);
-			std::ifstream geometryFile(geometryCode);
-			
-			if (geometryFile.is_open())
-			{
-				// Find out how many characters are in the file
-				geometryFile.seekg(0, geometryFile.end);
-				int length = (int)geometryFile.tellg();
-				geometryFile.seekg(0, geometryFile.beg);
-
-				// Create our buffer
-				gShaderText = new char[length];
-
-				// Transfer data from file to buffer
-				geometryFile.read(gShaderText, length);
-
-				// Check it reached the end of the file
-				if (!geometryFile.eof())
-				{
-					geometryFile.close();
-					std::cerr << "WARNING: could not read fragment shader from file: " << geometryCode << std::endl;
-					return;
-				}
-
-				// Find out how many characters were actually read
-				length = (int)geometryFile.gcount();
-
-				// Needs to be NULL-terminated
-				gShaderText[length - 1] = 0;
-
-				geometryFile.close();
-			}
-			else
+			std::cerr << "WARNING: no GL context for reloading shaders, edited shader files won't be picked up: " << SDL_GetError() << std::endl;
+			if (worker.window != nullptr)
 			{
-				std::cerr << "WARNING: could not open geometry shader from file: " << geometryCode << std::endl;
-				return;
+				SDL_DestroyWindow(worker.window);
+				worker.window = nullptr;
 			}
+			return false;
 		}
 
-		// 2. Compile the Shaders
-		unsigned int vertex, fragment, geometry;
-
-		//Vertex Shader
-		vertex = glCreateShader(GL_VERTEX_SHADER);
-		glShaderSource(vertex, 1, &vShaderText, NULL);
-		glCompileShader(vertex);
-		if (!CheckShaderCompiled(vertex))
-		{
-			std::cerr << "ERROR: failed to compile vertex shader" << std::endl;
-			return;
-		}
-		errorCheck(vertex, "VERTEX");
+		worker.stopping = false;
+		worker.thread = std::thread(ReloadThread);
+		return true;
+	}
 
-		//Fragment Shader
-		fragment = glCreateShader(GL_FRAGMENT_SHADER);
-		glShaderSource(fragment, 1, &fShaderText, NULL);
-		glCompileShader(fragment);
-		if (!CheckShaderCompiled(fragment))
+	//Call before the render context is deleted, a program the thread built that was never swapped in is deleted
+	static void StopReloadThread()
+	{
+		ReloadWorker& worker = Worker();
+		if (!worker.thread.joinable())
 		{
-			std::cerr << "ERROR: failed to compile fragment shader" << std::endl;
 			return;
 		}
-		errorCheck(fragment, "FRAGMENT");
 
-		//Geometry Shader
-		if (geometryPath != nullptr)
 		{
-			geometry = glCreateShader(GL_GEOMETRY_SHADER);
-			glShaderSource(geometry, 1, &gShaderText, NULL);
-			glCompileShader(geometry);
-			if (!CheckShaderCompiled(geometry))
-			{
-				std::cerr << "ERROR: failed to compile geometry shader" << std::endl;
-				return;
-			}
-			errorCheck(geometry, "GEOMETRY");
+			std::lock_guard<std::mutex> lock(worker.mutex);
+			worker.stopping = true;
 		}
-		
+		worker.wake.notify_all();
+		worker.thread.join();
 
-		//Shader Program
-		id = glCreateProgram();
-		glAttachShader(id, vertex);
-		glAttachShader(id, fragment);
-		if (geometryPath != nullptr)
+		SDL_GL_DeleteContext(worker.context);
+		SDL_DestroyWindow(worker.window);
+		worker.context = nullptr;
+		worker.window = nullptr;
+		for (unsigned int i = 0; i < worker.finished.size(); i++)
 		{
-			glAttachShader(id, geometry);
+			glDeleteProgram(worker.finished[i].program);
 		}
-		glLinkProgram(id);
-		errorCheck(id, "PROGRAM");
+		worker.finished.clear();
+	}
 
-		//Check if successfully linked.
-		GLint linked;
-		glGetProgramiv(id, GL_LINK_STATUS, &linked);
-		if (!linked)
+	//Swaps in the programs the reload thread has built since the last call, a program that didn't build is never handed over so the old one is kept
+	//Call this once a frame before anything is drawn, so a frame never mixes old and new programs
+	static void ReloadChangedSources()
+	{
+		ReloadWorker& worker = Worker();
+		std::vector<FinishedReload> finished;
 		{
-			GLsizei len;
-			glGetProgramiv(id, GL_INFO_LOG_LENGTH, &len);
-
-			GLchar* log = new GLchar[len + 1];
-			glGetProgramInfoLog(id, len, &len, log);
-			std::cerr << "ERROR: Shader linking failed: " << log << std::endl;
-			delete[] log;
-
-			return;
+			std::lock_guard<std::mutex> lock(worker.mutex);
+			finished.swap(worker.finished);
 		}
 
-		//Delete the shaders as they are now linked to our program and no longer neeeded
-		glDeleteShader(vertex);
-		glDeleteShader(fragment);
-		if (geometryPath != nullptr)
+		for (unsigned int i = 0; i < finished.size(); i++)
 		{
-			glDeleteShader(geometry);
+			finished[i].shader->swapInReload(finished[i].program);
 		}
-
 	}
 
+	//Linked programs are saved to this directory and loaded from it on later runs, instead of being compiled again
+	//It must end in a path separator, the cache is off while it is empty
+	static void SetBinaryCacheDirectory(const std::string& directory) { BinaryCacheDirectory() = directory; }
+
 	void use()
 	{
+		finish();
 		glUseProgram(id);
 	}
 
+	// Returns the location of a uniform from the reflected table, or -1 if it isn't active
+	GLint getUniformLocation(const std::string& name) const
+	{
+		finish();
+		std::unordered_map<std::string, UniformInfo>::const_iterator it = uniforms.find(name);
+		return it != uniforms.end() ? it->second.location : -1;
+	}
+
+	// Resolves a typed handle up front, so callers can keep it and skip the lookup every frame
+	template <typename T>
+	Uniform<T> getUniform(const std::string& name) const
+	{
+		return Uniform<T>(getUniformLocation(name));
+	}
+
 	// utility uniform functions
 	// ------------------------------------------------------------------------
 	void setBool(const std::string& name, bool value) const
 	{
-		glUniform1i(glGetUniformLocation(id, name.c_str()), (int)value);
+		glUniform1i(getUniformLocation(name), (int)value);
 	}
 	// ------------------------------------------------------------------------
 	void setInt(const std::string& name, int value) const
 	{
-		glUniform1i(glGetUniformLocation(id, name.c_str()), value);
+		glUniform1i(getUniformLocation(name), value);
 	}
 	// ------------------------------------------------------------------------
 	void setFloat(const std::string& name, float value) const
 	{
-		glUniform1f(glGetUniformLocation(id, name.c_str()), value);
+		glUniform1f(getUniformLocation(name), value);
 	}
 	// ------------------------------------------------------------------------
 	void setVec2(const std::string& name, const glm::vec2& value) const
 	{
-		glUniform2fv(glGetUniformLocation(id, name.c_str()), 1, &value[0]);
+		glUniform2fv(getUniformLocation(name), 1, &value[0]);
 	}
 	void setVec2(const std::string& name, float x, float y) const
 	{
-		glUniform2f(glGetUniformLocation(id, name.c_str()), x, y);
+		glUniform2f(getUniformLocation(name), x, y);
 	}
 	// ------------------------------------------------------------------------
 	void setVec3(const std::string& name, const glm::vec3& value) const
 	{
-		glUniform3fv(glGetUniformLocation(id, name.c_str()), 1, &value[0]);
+		glUniform3fv(getUniformLocation(name), 1, &value[0]);
 	}
 	void setVec3(const std::string& name, float x, float y, float z) const
 	{
-		glUniform3f(glGetUniformLocation(id, name.c_str()), x, y, z);
+		glUniform3f(getUniformLocation(name), x, y, z);
 	}
 	// ------------------------------------------------------------------------
 	void setVec4(const std::string& name, const glm::vec4& value) const
 	{
-		glUniform4fv(glGetUniformLocation(id, name.c_str()), 1, &value[0]);
+		glUniform4fv(getUniformLocation(name), 1, &value[0]);
 	}
 	void setVec4(const std::string& name, float x, float y, float z, float w)
 	{
-		glUniform4f(glGetUniformLocation(id, name.c_str()), x, y, z, w);
+		glUniform4f(getUniformLocation(name), x, y, z, w);
 	}
 	// ------------------------------------------------------------------------
 	void setMat2(const std::string& name, const glm::mat2& mat) const
 	{
-		glUniformMatrix2fv(glGetUniformLocation(id, name.c_str()), 1, GL_FALSE, &mat[0][0]);
+		glUniformMatrix2fv(getUniformLocation(name), 1, GL_FALSE, &mat[0][0]);
 	}
 	// ------------------------------------------------------------------------
 	void setMat3(const std::string& name, const glm::mat3& mat) const
 	{
-		glUniformMatrix3fv(glGetUniformLocation(id, name.c_str()), 1, GL_FALSE, &mat[0][0]);
+		glUniformMatrix3fv(getUniformLocation(name), 1, GL_FALSE, &mat[0][0]);
 	}
 	// ------------------------------------------------------------------------
 	void setMat4(const std::string& name, const glm::mat4& mat) const
 	{
-		int location = glGetUniformLocation(id, name.c_str());
-
-		glUniformMatrix4fv(glGetUniformLocation(id, name.c_str()), 1, GL_FALSE, glm::value_ptr(mat));
+		glUniformMatrix4fv(getUniformLocation(name), 1, GL_FALSE, glm::value_ptr(mat));
 	}
 
 private:
-	void errorCheck(GLuint shader, std::string type)
+	//Table of every active uniform, filled in after linking
+	mutable std::unordered_map<std::string, UniformInfo> uniforms;
+
+	//A compile and link that was started and not yet collected, a program from the binary cache comes already linked with no stages
+	//files is every file the sources were read from, includes too, and fileTimes the modification time each was read at
+	struct Build
+	{
+		GLuint program;
+		GLuint vertexStage, fragmentStage, geometryStage, computeStage;
+		std::string cachePath;
+		std::vector<std::string> files;
+		std::vector<time_t> fileTimes;
+	};
+
+	//What the program is built from, the reload thread builds it again from a copy when the files change
+	struct Sources
+	{
+		std::string vertexPath, fragmentPath, geometryPath, computePath;
+		std::string defines;
+
+		//The file messages about the program name it by, its fragment shader if it has one
+		const std::string& getName() const
+		{
+			return !computePath.empty() ? computePath : fragmentPath.empty() ? vertexPath : fragmentPath;
+		}
+	};
+	Sources sources;
+
+	//Every file it was last built from and the modification time each was read at, the reload thread watches them and keeps them up to date
+	std::vector<std::string> sourceFiles;
+	std::vector<time_t> sourceTimes;
+
+	//A source file as it was last read, it is only read again once its modification time or size changes
+	struct SourceFile
+	{
+		time_t modified;
+		long long size;
+		std::string text;
+	};
+
+	//The constructor's build is pending until finish collects it
+	Build initialBuild;
+	mutable bool pending;
+	mutable unsigned int revision;
+
+	//Tells it apart from a Shader made later at the same address, so a reload started for this one never goes to that one
+	unsigned int serial;
+
+	//A program the reload thread built, waiting for ReloadChangedSources to swap it in
+	struct FinishedReload
+	{
+		Shader* shader;
+		GLuint program;
+	};
+
+	//A registered Shader as the reload thread copied it
+	struct ReloadJob
+	{
+		Shader* shader;
+		unsigned int serial;
+		Sources sources;
+		std::vector<std::string> files;
+		std::vector<time_t> fileTimes;
+	};
+
+	//The reload thread and its context, mutex guards the registry, every Shader's sourceFiles and sourceTimes, and finished
+	struct ReloadWorker
+	{
+		ReloadWorker() : stopping(false), window(nullptr), context(nullptr) {}
+
+		std::thread thread;
+		std::mutex mutex;
+		std::condition_variable wake;
+		bool stopping;
+		SDL_Window* window;
+		SDL_GLContext context;
+		std::vector<FinishedReload> finished;
+	};
+
+	static ReloadWorker& Worker()
+	{
+		static ReloadWorker worker;
+		return worker;
+	}
+
+	static std::vector<Shader*>& Registry()
+	{
+		static std::vector<Shader*> shaders;
+		return shaders;
+	}
+
+	static unsigned int NextRevision()
+	{
+		static unsigned int revision = 0;
+		return ++revision;
+	}
+
+	static unsigned int NextSerial()
+	{
+		static unsigned int serial = 0;
+		return ++serial;
+	}
+
+	//Registers the Shader and starts building it from the paths the constructor set
+	void startInitialBuild()
+	{
+		id = 0;
+		revision = 0;
+		pending = false;
+		serial = NextSerial();
+
+		//Nothing here waits for the driver, it can compile and link in the background until finish collects the result
+		if (StartBuild(sources, initialBuild))
+		{
+			id = initialBuild.program;
+			pending = true;
+		}
+
+		//The files it includes are watched for changes as well
+		std::lock_guard<std::mutex> lock(Worker().mutex);
+		sourceFiles = initialBuild.files;
+		sourceTimes = initialBuild.fileTimes;
+		Registry().push_back(this);
+	}
+
+	//Reads the source files and starts compiling and linking them into a new program, or loads it from the binary cache
+	//Returns false if a file can't be read
+	static bool StartBuild(const Sources& sources, Build& build)
+	{
+		build.program = 0;
+		build.vertexStage = build.fragmentStage = build.geometryStage = build.computeStage = 0;
+		build.files.clear();
+		build.fileTimes.clear();
+
+		if (!sources.computePath.empty())
+		{
+			std::string cSource;
+			if (!LoadSource(sources.computePath, sources.defines, cSource, build))
+			{
+				return false;
+			}
+
+			build.cachePath = GetBinaryCachePath(cSource);
+			build.program = LoadProgramBinary(build.cachePath);
+			if (build.program != 0)
+			{
+				return true;
+			}
+
+			build.computeStage = glCreateShader(GL_COMPUTE_SHADER);
+			const char* cSourceText = cSource.c_str();
+			glShaderSource(build.computeStage, 1, &cSourceText, NULL);
+			glCompileShader(build.computeStage);
+
+			build.program = glCreateProgram();
+			glAttachShader(build.program, build.computeStage);
+			glProgramParameteri(build.program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+			glLinkProgram(build.program);
+			return true;
+		}
+
+		//Every stage's source as it is compiled
+		std::string vSource, fSource, gSource;
+		if (!LoadSource(sources.vertexPath, sources.defines, vSource, build) || (!sources.fragmentPath.empty() && !LoadSource(sources.fragmentPath, sources.defines, fSource, build)))
+		{
+			return false;
+		}
+		if (!sources.geometryPath.empty() && !LoadSource(sources.geometryPath, sources.defines, gSource, build))
+		{
+			return false;
+		}
+
+		//An earlier run that linked the same sources on the same driver left the program in the binary cache
+		build.cachePath = GetBinaryCachePath(vSource + '\0' + fSource + '\0' + gSource);
+		build.program = LoadProgramBinary(build.cachePath);
+		if (build.program != 0)
+		{
+			return true;
+		}
+
+		// 2. Compile the Shaders
+
+		//Vertex Shader
+		build.vertexStage = glCreateShader(GL_VERTEX_SHADER);
+		const char* vSourceText = vSource.c_str();
+		glShaderSource(build.vertexStage, 1, &vSourceText, NULL);
+		glCompileShader(build.vertexStage);
+
+		//Fragment Shader
+		if (!fSource.empty())
+		{
+			build.fragmentStage = glCreateShader(GL_FRAGMENT_SHADER);
+			const char* fSourceText = fSource.c_str();
+			glShaderSource(build.fragmentStage, 1, &fSourceText, NULL);
+			glCompileShader(build.fragmentStage);
+		}
+
+		//Geometry Shader
+		if (!gSource.empty())
+		{
+			build.geometryStage = glCreateShader(GL_GEOMETRY_SHADER);
+			const char* gSourceText = gSource.c_str();
+			glShaderSource(build.geometryStage, 1, &gSourceText, NULL);
+			glCompileShader(build.geometryStage);
+		}
+
+
+		//Shader Program
+		build.program = glCreateProgram();
+		glAttachShader(build.program, build.vertexStage);
+		if (build.fragmentStage != 0)
+		{
+			glAttachShader(build.program, build.fragmentStage);
+		}
+		if (build.geometryStage != 0)
+		{
+			glAttachShader(build.program, build.geometryStage);
+		}
+		//Without the hint the driver doesn't have to keep a binary it can hand back
+		glProgramParameteri(build.program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+		glLinkProgram(build.program);
+		return true;
+	}
+
+	//Waits for a build, reports any errors and deletes its stages. Returns whether the program linked.
+	static bool FinishBuild(const Build& build)
+	{
+		if (build.vertexStage == 0 && build.computeStage == 0)
+		{
+			return build.program != 0;
+		}
+
+		bool compiled = true;
+		if (build.vertexStage != 0)
+		{
+			if (!CheckShaderCompiled(build.vertexStage))
+			{
+				std::cerr << "ERROR: failed to compile vertex shader" << std::endl;
+				compiled = false;
+			}
+			errorCheck(build.vertexStage, "VERTEX");
+		}
+
+		if (build.fragmentStage != 0)
+		{
+			if (!CheckShaderCompiled(build.fragmentStage))
+			{
+				std::cerr << "ERROR: failed to compile fragment shader" << std::endl;
+				compiled = false;
+			}
+			errorCheck(build.fragmentStage, "FRAGMENT");
+		}
+
+		if (build.geometryStage != 0)
+		{
+			if (!CheckShaderCompiled(build.geometryStage))
+			{
+				std::cerr << "ERROR: failed to compile geometry shader" << std::endl;
+				compiled = false;
+			}
+			errorCheck(build.geometryStage, "GEOMETRY");
+		}
+
+		if (build.computeStage != 0)
+		{
+			if (!CheckShaderCompiled(build.computeStage))
+			{
+				std::cerr << "ERROR: failed to compile compute shader" << std::endl;
+				compiled = false;
+			}
+			errorCheck(build.computeStage, "COMPUTE");
+		}
+		errorCheck(build.program, "PROGRAM");
+		if (!compiled)
+		{
+			std::cerr << "ERROR: the errors' source string numbers are these files" << std::endl;
+			PrintSourceFiles(build);
+		}
+
+		//Check if successfully linked.
+		GLint linked;
+		glGetProgramiv(build.program, GL_LINK_STATUS, &linked);
+		if (!linked)
+		{
+			GLsizei len;
+			glGetProgramiv(build.program, GL_INFO_LOG_LENGTH, &len);
+
+			GLchar* log = new GLchar[len + 1];
+			glGetProgramInfoLog(build.program, len, &len, log);
+			std::cerr << "ERROR: Shader linking failed: " << log << std::endl;
+			delete[] log;
+		}
+		else
+		{
+			SaveProgramBinary(build.program, build.cachePath);
+		}
+
+		//Delete the shaders as they are now linked to our program and no longer neeeded
+		if (build.vertexStage != 0)
+		{
+			glDeleteShader(build.vertexStage);
+		}
+		if (build.fragmentStage != 0)
+		{
+			glDeleteShader(build.fragmentStage);
+		}
+		if (build.geometryStage != 0)
+		{
+			glDeleteShader(build.geometryStage);
+		}
+		if (build.computeStage != 0)
+		{
+			glDeleteShader(build.computeStage);
+		}
+		return linked == GL_TRUE;
+	}
+
+	//Watches the registered Shaders' files and builds the ones that changed, with its own context current the whole time
+	//Only the copying and handing over hold the lock, Shaders can come and go while it reads and builds
+	static void ReloadThread()
+	{
+		ReloadWorker& worker = Worker();
+		SDL_GL_MakeCurrent(worker.window, worker.context);
+
+		std::unique_lock<std::mutex> lock(worker.mutex);
+		while (!worker.stopping)
+		{
+			worker.wake.wait_for(lock, std::chrono::milliseconds(500));
+			if (worker.stopping)
+			{
+				break;
+			}
+
+			std::vector<ReloadJob> jobs;
+			std::vector<Shader*>& shaders = Registry();
+			for (unsigned int i = 0; i < shaders.size(); i++)
+			{
+				ReloadJob job = { shaders[i], shaders[i]->serial, shaders[i]->sources, shaders[i]->sourceFiles, shaders[i]->sourceTimes };
+				jobs.push_back(job);
+			}
+			lock.unlock();
+
+			for (unsigned int i = 0; i < jobs.size(); i++)
+			{
+				if (GetSourceTimes(jobs[i].files) == jobs[i].fileTimes)
+				{
+					continue;
+				}
+
+				Build build;
+				bool built = StartBuild(jobs[i].sources, build);
+				if (built && !FinishBuild(build))
+				{
+					std::cerr << "WARNING: " << jobs[i].sources.getName() << " failed to build, keeping the program it had" << std::endl;
+					glDeleteProgram(build.program);
+					built = false;
+				}
+
+				//The render context can only use the program once everything done to it here has finished
+				glFinish();
+
+				//An edit can add or remove includes, so what is watched changes with it
+				lock.lock();
+				std::vector<Shader*>::iterator found = std::find(shaders.begin(), shaders.end(), jobs[i].shader);
+				if (found != shaders.end() && (*found)->serial == jobs[i].serial)
+				{
+					(*found)->sourceFiles = build.files;
+					(*found)->sourceTimes = build.fileTimes;
+					if (built)
+					{
+						FinishedReload reload = { *found, build.program };
+						worker.finished.push_back(reload);
+					}
+				}
+				else if (built)
+				{
+					glDeleteProgram(build.program);
+				}
+				lock.unlock();
+			}
+			lock.lock();
+		}
+		lock.unlock();
+
+		SDL_GL_MakeCurrent(worker.window, nullptr);
+	}
+
+	//Replaces the program with one the reload thread built
+	void swapInReload(GLuint program)
+	{
+		finish();
+		glDeleteProgram(id);
+		id = program;
+		revision = NextRevision();
+		uniforms.clear();
+		reflectUniforms();
+		std::cout << "INFO: reloaded " << (sources.computePath.empty() ? sources.vertexPath : sources.computePath) << (sources.fragmentPath.empty() ? "" : " and " + sources.fragmentPath) << std::endl;
+	}
+
+	//Modification times of the files, one that can't be found counts as 0
+	static std::vector<time_t> GetSourceTimes(const std::vector<std::string>& files)
+	{
+		std::vector<time_t> times;
+		for (unsigned int i = 0; i < files.size(); i++)
+		{
+			struct stat info;
+			times.push_back(stat(files[i].c_str(), &info) == 0 ? info.st_mtime : 0);
+		}
+		return times;
+	}
+
+	void reflectUniforms() const
+	{
+		GLint count = 0, maxLength = 0;
+		glGetProgramiv(id, GL_ACTIVE_UNIFORMS, &count);
+		glGetProgramiv(id, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxLength);
+
+		std::vector<GLchar> nameBuffer(maxLength > 0 ? maxLength : 1);
+		uniforms.reserve(count);
+
+		for (GLint i = 0; i < count; i++)
+		{
+			GLsizei length = 0;
+			UniformInfo info;
+			glGetActiveUniform(id, (GLuint)i, maxLength, &length, &info.size, &info.type, nameBuffer.data());
+			std::string name(nameBuffer.data(), length);
+
+			//Arrays are reported once as "name[0]", so register the bare name and every element
+			std::string::size_type bracket = name.find('[');
+			std::string baseName = bracket == std::string::npos ? name : name.substr(0, bracket);
+
+			info.location = glGetUniformLocation(id, name.c_str());
+
+			//Members of uniform blocks have no location
+			if (info.location == -1)
+			{
+				continue;
+			}
+
+			uniforms[baseName] = info;
+			for (GLint element = 0; info.size > 1 && element < info.size; element++)
+			{
+				std::string elementName = baseName + "[" + std::to_string(element) + "]";
+				UniformInfo elementInfo = info;
+				elementInfo.location = glGetUniformLocation(id, elementName.c_str());
+				elementInfo.size = 1;
+				uniforms[elementName] = elementInfo;
+			}
+			if (info.size == 1 && bracket != std::string::npos)
+			{
+				uniforms[name] = info;
+			}
+		}
+	}
+
+	static void errorCheck(GLuint shader, std::string type)
 	{
 		GLint success;
 		GLchar infoLog[1024];
@@ -314,8 +778,246 @@ private:
 		}
 	}
 
+	static std::string& BinaryCacheDirectory()
+	{
+		static std::string directory;
+		return directory;
+	}
+
+	//The cache file is named after a hash of the sources and of everything about the driver that could change what they compile to
+	//Returns an empty path if the cache is off or the driver has no binary formats
+	static std::string GetBinaryCachePath(const std::string& sources)
+	{
+		GLint numFormats = 0;
+		glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &numFormats);
+		if (BinaryCacheDirectory().empty() || numFormats == 0)
+		{
+			return std::string();
+		}
+
+		std::string key = sources;
+		const GLenum driverStrings[] = { GL_VENDOR, GL_RENDERER, GL_VERSION, GL_SHADING_LANGUAGE_VERSION };
+		for (int i = 0; i < 4; i++)
+		{
+			const GLubyte* value = glGetString(driverStrings[i]);
+			key += '\0';
+			key += value ? (const char*)value : "";
+		}
+
+		//64 bit FNV-1a
+		unsigned long long hash = 14695981039346656037ull;
+		for (std::string::size_type i = 0; i < key.size(); i++)
+		{
+			hash ^= (unsigned char)key[i];
+			hash *= 1099511628211ull;
+		}
+
+		std::ostringstream path;
+		path << BinaryCacheDirectory() << std::hex << std::setw(16) << std::setfill('0') << hash << ".bin";
+		return path.str();
+	}
+
+	//Creates a program from a cached binary and returns it, or 0 if there isn't a usable one. The file holds the binary format followed by the binary
+	static GLuint LoadProgramBinary(const std::string& path)
+	{
+		if (path.empty())
+		{
+			return 0;
+		}
+
+		std::ifstream file(path, std::ios::binary);
+		if (!file.is_open())
+		{
+			return 0;
+		}
+
+		GLenum format = 0;
+		file.read((char*)&format, sizeof(format));
+		std::vector<char> binary((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+		if (binary.empty())
+		{
+			return 0;
+		}
+
+		GLuint program = glCreateProgram();
+		glProgramBinary(program, format, binary.data(), (GLsizei)binary.size());
+
+		//A driver can still turn down a binary it made, then the sources are compiled as if there was no cache
+		GLint linked;
+		glGetProgramiv(program, GL_LINK_STATUS, &linked);
+		if (!linked)
+		{
+			std::cout << "INFO: program binary " << path << " was rejected, compiling it again" << std::endl;
+			glDeleteProgram(program);
+			return 0;
+		}
+		return program;
+	}
+
+	static void SaveProgramBinary(GLuint program, const std::string& path)
+	{
+		if (path.empty())
+		{
+			return;
+		}
+
+		GLint length = 0;
+		glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+		if (length <= 0)
+		{
+			return;
+		}
+
+		std::vector<char> binary(length);
+		GLenum format = 0;
+		glGetProgramBinary(program, length, &length, &format, binary.data());
+
+		std::ofstream file(path, std::ios::binary);
+		if (!file.is_open())
+		{
+			std::cerr << "WARNING: could not write program binary: " << path << std::endl;
+			return;
+		}
+		file.write((const char*)&format, sizeof(format));
+		file.write(binary.data(), length);
+	}
+
+	static std::unordered_map<std::string, SourceFile>& SourceFiles()
+	{
+		static std::unordered_map<std::string, SourceFile> files;
+		return files;
+	}
+
+	//The reload thread reads sources too, this guards SourceFiles
+	static std::mutex& SourceFilesMutex()
+	{
+		static std::mutex mutex;
+		return mutex;
+	}
+
+	//Returns the text of a source file, read in one go the first time and again only after it changes, or null if it can't be read
+	static const SourceFile* ReadSourceFile(const std::string& path)
+	{
+		struct stat info;
+		if (stat(path.c_str(), &info) != 0)
+		{
+			return nullptr;
+		}
+
+		std::unordered_map<std::string, SourceFile>::iterator it = SourceFiles().find(path);
+		if (it != SourceFiles().end() && it->second.modified == info.st_mtime && it->second.size == (long long)info.st_size)
+		{
+			return &it->second;
+		}
+
+		std::ifstream file(path, std::ios::binary);
+		std::string text((std::string::size_type)info.st_size, '\0');
+		if (!file.is_open() || !file.read(&text[0], (std::streamsize)text.size()))
+		{
+			return nullptr;
+		}
+
+		SourceFile& source = SourceFiles()[path];
+		source.modified = info.st_mtime;
+		source.size = info.st_size;
+		source.text.swap(text);
+		return &source;
+	}
+
+	//Builds one stage's source from its file, with the defines put after the #version line, which has to come first
+	//Each #include "file" line is replaced by the file it names, looked for next to the file including it, and a file is only included once per stage
+	//#line directives keep compile errors pointing at the line in the file they came from, the source string number is the file's index in build.files
+	static bool LoadSource(const std::string& path, const std::string& defines, std::string& source, Build& build)
+	{
+		std::lock_guard<std::mutex> lock(SourceFilesMutex());
+		std::vector<std::string> included;
+		source.clear();
+		return AppendSource(path, &defines, source, build, included);
+	}
+
+	static bool AppendSource(const std::string& path, const std::string* defines, std::string& source, Build& build, std::vector<std::string>& included)
+	{
+		const SourceFile* file = ReadSourceFile(path);
+
+		//Watch the file even if it couldn't be read, so putting it back triggers a reload
+		std::vector<std::string>::iterator found = std::find(build.files.begin(), build.files.end(), path);
+		int fileIndex = (int)(found - build.files.begin());
+		if (found == build.files.end())
+		{
+			build.files.push_back(path);
+			build.fileTimes.push_back(file != nullptr ? file->modified : 0);
+		}
+		if (file == nullptr)
+		{
+			std::cerr << "WARNING: could not read shader file: " << path << std::endl;
+			return false;
+		}
+		included.push_back(path);
+		if (defines == nullptr)
+		{
+			source += "#line 1 " + std::to_string(fileIndex) + '\n';
+		}
+
+		const std::string& text = file->text;
+		std::string directory = path.substr(0, path.find_last_of("/\\") + 1);
+		std::string::size_type lineStart = 0;
+		for (int lineNumber = 1; lineStart < text.size(); lineNumber++)
+		{
+			std::string::size_type lineEnd = text.find('\n', lineStart);
+			if (lineEnd == std::string::npos)
+			{
+				lineEnd = text.size();
+			}
+			std::string line = text.substr(lineStart, lineEnd - lineStart);
+			lineStart = lineEnd + 1;
+
+			std::string::size_type first = line.find_first_not_of(" \t");
+			if (first == std::string::npos || line.compare(first, 8, "#include") != 0)
+			{
+				source += line + '\n';
+			}
+			else
+			{
+				std::string::size_type open = line.find('"', first);
+				std::string::size_type close = open == std::string::npos ? open : line.find('"', open + 1);
+				if (close == std::string::npos)
+				{
+					std::cerr << "ERROR: " << path << "(" << lineNumber << "): #include needs a file name in quotes" << std::endl;
+					return false;
+				}
+
+				std::string includePath = directory + line.substr(open + 1, close - open - 1);
+				if (std::find(included.begin(), included.end(), includePath) == included.end())
+				{
+					if (!AppendSource(includePath, nullptr, source, build, included))
+					{
+						std::cerr << "ERROR: included from " << path << "(" << lineNumber << ")" << std::endl;
+						return false;
+					}
+				}
+				source += "#line " + std::to_string(lineNumber + 1) + " " + std::to_string(fileIndex) + '\n';
+			}
+
+			//Only the top file has a #version line to put the defines after
+			if (lineNumber == 1 && defines != nullptr)
+			{
+				source += *defines + "#line 2 " + std::to_string(fileIndex) + '\n';
+			}
+		}
+		return true;
+	}
+
+	//Compile errors give the source string number, this says which file that is
+	static void PrintSourceFiles(const Build& build)
+	{
+		for (unsigned int i = 0; i < build.files.size(); i++)
+		{
+			std::cerr << "  " << i << ": " << build.files[i] << std::endl;
+		}
+	}
+
 	//Checks if the shader compiles or not
-	bool CheckShaderCompiled(GLuint shader)
+	static bool CheckShaderCompiled(GLuint shader)
 	{
 		GLint compiled;
 		glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
@@ -336,5 +1038,4 @@ private:
 	}
 };
 
-
-
+#endif
@@ -0,0 +1,56 @@
+
+#include "ShaderLibrary.h"
+
+ShaderLibrary::ShaderLibrary()
+{
+}
+
+ShaderLibrary::~ShaderLibrary()
+{
+	for (std::unordered_map<unsigned long long, Shader*>::iterator it = _permutations.begin(); it != _permutations.end(); ++it)
+	{
+		glDeleteProgram(it->second->id);
+		delete it->second;
+	}
+}
+
+unsigned int ShaderLibrary::AddProgram(const char* vertexPath, const char* fragmentPath, const char* geometryPath, DefinesFunction definesFunction)
+{
+	Program program;
+	program.vertexPath = vertexPath;
+	program.fragmentPath = fragmentPath ? fragmentPath : "";
+	program.geometryPath = geometryPath ? geometryPath : "";
+	program.definesFunction = definesFunction;
+	_programs.push_back(program);
+	return (unsigned int)_programs.size() - 1;
+}
+
+Shader& ShaderLibrary::Get(unsigned int program, unsigned int features)
+{
+	unsigned long long key = ((unsigned long long)program << 32) | features;
+	std::unordered_map<unsigned long long, Shader*>::iterator it = _permutations.find(key);
+	if (it != _permutations.end())
+	{
+		return *it->second;
+	}
+
+	const Program& base = _programs[program];
+	std::cout << "INFO: compiling " << (base.fragmentPath.empty() ? base.vertexPath : base.fragmentPath) << " with features 0x" << std::hex << features << std::dec << std::endl;
+	std::string defines = base.definesFunction ? base.definesFunction(features) : std::string();
+	Shader* shader = new Shader(base.vertexPath.c_str(), base.fragmentPath.c_str(), base.geometryPath.empty() ? nullptr : base.geometryPath.c_str(), defines);
+	_permutations[key] = shader;
+	return *shader;
+}
+
+unsigned int ShaderLibrary::GetNumPermutations(unsigned int program) const
+{
+	unsigned int numPermutations = 0;
+	for (std::unordered_map<unsigned long long, Shader*>::const_iterator it = _permutations.begin(); it != _permutations.end(); ++it)
+	{
+		if ((unsigned int)(it->first >> 32) == program)
+		{
+			numPermutations++;
+		}
+	}
+	return numPermutations;
+}
@@ -0,0 +1,46 @@
+#ifndef __SHADERLIBRARY_H__
+#define __SHADERLIBRARY_H__
+
+#include "Shader.h"
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Every permutation of a set of base programs, compiled the first time it is asked for and kept
+// A permutation is a base program plus a feature mask, the program's defines function turns the mask into the #define block it is compiled with
+// so one set of source files covers every combination of features without dynamic branches in the shaders
+class ShaderLibrary
+{
+public:
+	// Builds the #define block for a feature mask, see Shader. The layout of the mask is up to whoever owns the program.
+	typedef std::string (*DefinesFunction)(unsigned int features);
+
+	ShaderLibrary();
+	~ShaderLibrary();
+
+	// Adds a base program and returns its ID for Get. With no defines function every permutation compiles the files as they are.
+	unsigned int AddProgram(const char* vertexPath, const char* fragmentPath, const char* geometryPath = nullptr, DefinesFunction definesFunction = nullptr);
+
+	// Compiles the permutation if it isn't in the library yet
+	Shader& Get(unsigned int program, unsigned int features);
+
+	// Number of permutations compiled so far, of one program or of all of them
+	unsigned int GetNumPermutations(unsigned int program) const;
+	unsigned int GetNumPermutations() const { return (unsigned int)_permutations.size(); }
+
+protected:
+
+	struct Program
+	{
+		std::string vertexPath;
+		std::string fragmentPath;
+		std::string geometryPath;
+		DefinesFunction definesFunction;
+	};
+	std::vector<Program> _programs;
+
+	// Keyed by the program ID in the high word and the feature mask in the low word
+	std::unordered_map<unsigned long long, Shader*> _permutations;
+};
+
+#endif
@@ -0,0 +1,276 @@
+
+#include "ShadowAtlas.h"
+#include <iostream>
+
+ShadowAtlas::ShadowAtlas(int size, int minTileSize, GLenum depthFormat)
+{
+	_size = size;
+	_depthFormat = depthFormat;
+	if (GetDepthFormatBytes(_depthFormat) == 0)
+	{
+		std::cerr << "ERROR: shadow atlas can't use depth format 0x" << std::hex << depthFormat << std::dec << ", using GL_DEPTH_COMPONENT16" << std::endl;
+		_depthFormat = GL_DEPTH_COMPONENT16;
+	}
+	_frame = 0;
+	_numEvictions = 0;
+
+	//One level per halving of the tile size, down to minTileSize
+	_numLevels = 1;
+	while ((size >> _numLevels) >= minTileSize)
+	{
+		_numLevels++;
+	}
+
+	//Lay out every node of the tree up front, a full quadtree with _numLevels levels has (4^levels - 1) / 3 nodes
+	int numNodes = ((1 << (2 * _numLevels)) - 1) / 3;
+	_nodeState.assign(numNodes, NODE_FREE);
+	_nodeLevel.resize(numNodes);
+	_nodeX.resize(numNodes);
+	_nodeY.resize(numNodes);
+	_nodeKey.resize(numNodes);
+	_nodeLastUsed.assign(numNodes, 0);
+	_nodeStaticCached.assign(numNodes, 0);
+
+	_nodeLevel[0] = 0;
+	_nodeX[0] = 0, _nodeY[0] = 0;
+	for (int node = 0; node * 4 + 4 < numNodes; node++)
+	{
+		int half = (_size >> _nodeLevel[node]) / 2;
+		for (int i = 0; i < 4; i++)
+		{
+			int child = node * 4 + 1 + i;
+			_nodeLevel[child] = _nodeLevel[node] + 1;
+			_nodeX[child] = _nodeX[node] + (i & 1) * half;
+			_nodeY[child] = _nodeY[node] + (i >> 1) * half;
+		}
+	}
+
+	//The texture the tiles live in, and the one their static copies live in. They have to match for CopyStaticTile.
+	CreateDepthTarget(_depthFormat, _texture, _framebuffer);
+	CreateDepthTarget(_depthFormat, _staticTexture, _staticFramebuffer);
+
+	//A fetch through this passes if the reference depth is no further than the stored one, 1 is lit and 0 shadowed
+	glGenSamplers(1, &_compareSampler);
+	glSamplerParameteri(_compareSampler, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glSamplerParameteri(_compareSampler, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glSamplerParameteri(_compareSampler, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glSamplerParameteri(_compareSampler, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glSamplerParameteri(_compareSampler, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+	glSamplerParameteri(_compareSampler, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+	std::cout << "INFO: shadow atlas " << _size << "x" << _size << " " << GetDepthFormatName(_depthFormat) << " with " << _numLevels << " tile sizes" << std::endl;
+}
+
+ShadowAtlas::~ShadowAtlas()
+{
+	glDeleteFramebuffers(1, &_framebuffer);
+	glDeleteTextures(1, &_texture);
+	glDeleteFramebuffers(1, &_staticFramebuffer);
+	glDeleteTextures(1, &_staticTexture);
+	glDeleteSamplers(1, &_compareSampler);
+}
+
+void ShadowAtlas::CreateDepthTarget(GLenum internalFormat, GLuint& texture, GLuint& framebuffer)
+{
+	glGenTextures(1, &texture);
+	glBindTexture(GL_TEXTURE_2D, texture);
+	glTexStorage2D(GL_TEXTURE_2D, 1, internalFormat, _size, _size);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	//Attach it as the depth buffer of a framebuffer the shadow passes can render to
+	glGenFramebuffers(1, &framebuffer);
+	glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, texture, 0);
+	glDrawBuffer(GL_NONE);
+	glReadBuffer(GL_NONE);
+
+	if (GL_FRAMEBUFFER_COMPLETE != glCheckFramebufferStatus(GL_FRAMEBUFFER)) {
+		std::cerr << "ERROR: shadow atlas frame buffer incomplete" << std::endl;
+	}
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+size_t ShadowAtlas::GetMemoryBytes() const
+{
+	return 2 * (size_t)_size * _size * GetDepthFormatBytes(_depthFormat);
+}
+
+int ShadowAtlas::GetDepthFormatBytes(GLenum depthFormat)
+{
+	switch (depthFormat)
+	{
+	case GL_DEPTH_COMPONENT16: return 2;
+	case GL_DEPTH_COMPONENT24: return 4;
+	case GL_DEPTH_COMPONENT32F: return 4;
+	default: return 0;
+	}
+}
+
+const char* ShadowAtlas::GetDepthFormatName(GLenum depthFormat)
+{
+	switch (depthFormat)
+	{
+	case GL_DEPTH_COMPONENT16: return "GL_DEPTH_COMPONENT16";
+	case GL_DEPTH_COMPONENT24: return "GL_DEPTH_COMPONENT24";
+	case GL_DEPTH_COMPONENT32F: return "GL_DEPTH_COMPONENT32F";
+	default: return "unknown depth format";
+	}
+}
+
+void ShadowAtlas::BeginFrame()
+{
+	_frame++;
+}
+
+int ShadowAtlas::AcquireTile(unsigned int key, int size)
+{
+	//Round down to the nearest tile size the tree has
+	int level = 0;
+	while ((_size >> level) > size && level < _numLevels - 1)
+	{
+		level++;
+	}
+
+	//Keep the tile from last time if it is the size we want
+	std::unordered_map<unsigned int, int>::iterator existing = _tileNodes.find(key);
+	if (existing != _tileNodes.end())
+	{
+		int node = existing->second;
+		if (_nodeLevel[node] == level)
+		{
+			_nodeLastUsed[node] = _frame;
+			return node;
+		}
+
+		FreeNode(node);
+		_tileNodes.erase(existing);
+	}
+
+	for (; level < _numLevels; level++)
+	{
+		//Evict stale tiles until this size fits, then fall back to the next size down
+		do
+		{
+			int node = FindNode(0, 0, level);
+			if (node >= 0)
+			{
+				_nodeState[node] = NODE_USED;
+				_nodeKey[node] = key;
+				_nodeLastUsed[node] = _frame;
+				_nodeStaticCached[node] = 0;
+				_tileNodes[key] = node;
+				return node;
+			}
+		} while (EvictLeastRecentlyUsed());
+	}
+
+	return -1;
+}
+
+void ShadowAtlas::ReleaseTile(unsigned int key)
+{
+	std::unordered_map<unsigned int, int>::iterator existing = _tileNodes.find(key);
+	if (existing != _tileNodes.end())
+	{
+		FreeNode(existing->second);
+		_tileNodes.erase(existing);
+	}
+}
+
+glm::vec4 ShadowAtlas::GetTileScaleOffset(int tile) const
+{
+	float scale = (float)GetTileSize(tile) / (float)_size;
+	return glm::vec4(scale, scale, (float)_nodeX[tile] / (float)_size, (float)_nodeY[tile] / (float)_size);
+}
+
+void ShadowAtlas::CopyStaticTile(int tile)
+{
+	//A straight texel copy on the GPU, no framebuffers or shaders involved
+	int x = _nodeX[tile], y = _nodeY[tile], size = GetTileSize(tile);
+	glCopyImageSubData(_staticTexture, GL_TEXTURE_2D, 0, x, y, 0, _texture, GL_TEXTURE_2D, 0, x, y, 0, size, size, 1);
+}
+
+int ShadowAtlas::FindNode(int node, int level, int targetLevel)
+{
+	if (_nodeState[node] == NODE_USED)
+	{
+		return -1;
+	}
+
+	if (level == targetLevel)
+	{
+		return _nodeState[node] == NODE_FREE ? node : -1;
+	}
+
+	//A free node is split on the way down, all of its children are free
+	_nodeState[node] = NODE_SPLIT;
+
+	//Look in children that are already split first, so whole free quadrants are kept for bigger tiles
+	for (int pass = 0; pass < 2; pass++)
+	{
+		for (int i = 0; i < 4; i++)
+		{
+			int child = node * 4 + 1 + i;
+			if ((_nodeState[child] == NODE_SPLIT) != (pass == 0))
+			{
+				continue;
+			}
+
+			int found = FindNode(child, level + 1, targetLevel);
+			if (found >= 0)
+			{
+				return found;
+			}
+		}
+	}
+
+	return -1;
+}
+
+void ShadowAtlas::FreeNode(int node)
+{
+	_nodeState[node] = NODE_FREE;
+
+	//Merge back up while all four siblings are free
+	while (node > 0)
+	{
+		int parent = (node - 1) / 4;
+		for (int i = 0; i < 4; i++)
+		{
+			if (_nodeState[parent * 4 + 1 + i] != NODE_FREE)
+			{
+				return;
+			}
+		}
+
+		_nodeState[parent] = NODE_FREE;
+		node = parent;
+	}
+}
+
+bool ShadowAtlas::EvictLeastRecentlyUsed()
+{
+	//Tiles used this frame are about to be drawn or sampled, so they are never evicted
+	std::unordered_map<unsigned int, int>::iterator oldest = _tileNodes.end();
+	for (std::unordered_map<unsigned int, int>::iterator it = _tileNodes.begin(); it != _tileNodes.end(); ++it)
+	{
+		unsigned int lastUsed = _nodeLastUsed[it->second];
+		if (lastUsed != _frame && (oldest == _tileNodes.end() || lastUsed < _nodeLastUsed[oldest->second]))
+		{
+			oldest = it;
+		}
+	}
+
+	if (oldest == _tileNodes.end())
+	{
+		return false;
+	}
+
+	FreeNode(oldest->second);
+	_tileNodes.erase(oldest);
+	_numEvictions++;
+	return true;
+}
@@ -0,0 +1,108 @@
+#ifndef __SHADOWATLAS_H__
+#define __SHADOWATLAS_H__
+
+#include "glew.h"
+#include <GLM/glm.hpp>
+#include <unordered_map>
+#include <vector>
+
+// One large depth texture that every shadow map in the scene is rendered into
+// Square power of two tiles are handed out by a quadtree, and tiles that haven't been used recently are evicted first
+// The memory used for shadows is fixed by the atlas size, however many lights ask for tiles
+class ShadowAtlas
+{
+public:
+	// size and minTileSize must be powers of two
+	// depthFormat is GL_DEPTH_COMPONENT16, GL_DEPTH_COMPONENT24 or GL_DEPTH_COMPONENT32F, it sets the shadow memory along with the size
+	ShadowAtlas(int size, int minTileSize, GLenum depthFormat);
+	~ShadowAtlas();
+
+	// Starts a new frame, tiles acquired from here on count as used this frame and can't be evicted until the next one
+	void BeginFrame();
+
+	// Returns the tile owned by key, reallocating it if it is gone or a different size
+	// If the atlas is full the least recently used tiles from earlier frames are evicted, and if that isn't enough a smaller tile is tried
+	// Returns -1 if not even a minTileSize tile could be found
+	int AcquireTile(unsigned int key, int size);
+
+	// Gives key's tile back so the space can be reused straight away
+	void ReleaseTile(unsigned int key);
+
+	// Tile position and size in texels
+	int GetTileX(int tile) const { return _nodeX[tile]; }
+	int GetTileY(int tile) const { return _nodeY[tile]; }
+	int GetTileSize(int tile) const { return _size >> _nodeLevel[tile]; }
+
+	// Maps [0,1] shadow map coordinates into the tile, uv * (x, y) + (z, w)
+	glm::vec4 GetTileScaleOffset(int tile) const;
+
+	GLuint GetTexture() const { return _texture; }
+	GLuint GetFramebuffer() const { return _framebuffer; }
+
+	// Sampler for reading the atlas through a sampler2DShadow, every fetch or gather compares against a reference depth in hardware
+	// Bind it to the atlas's texture unit for the lit pass only, anything reading the raw depths wants the texture's own plain sampling
+	GLuint GetCompareSampler() const { return _compareSampler; }
+
+	// Every tile has a static copy in a second texture, holding only the shadows of objects that never move
+	// It is drawn when it goes out of date and copied into the tile at the start of each frame's depth pass, then the moving objects go on top
+	GLuint GetStaticFramebuffer() const { return _staticFramebuffer; }
+
+	// Whether the tile's static copy is up to date, a newly allocated tile's never is
+	bool IsStaticCached(int tile) const { return _nodeStaticCached[tile] != 0; }
+	void SetStaticCached(int tile, bool cached) { _nodeStaticCached[tile] = cached ? 1 : 0; }
+
+	// Overwrites the tile with its static copy
+	void CopyStaticTile(int tile);
+	int GetSize() const { return _size; }
+	int GetMinTileSize() const { return _size >> (_numLevels - 1); }
+
+	GLenum GetDepthFormat() const { return _depthFormat; }
+
+	// Bytes of video memory the atlas texture and its static copy take together
+	size_t GetMemoryBytes() const;
+
+	// Bytes a texel of the depth format takes, 24 bit depth is padded to 32 bits. 0 for a format the atlas can't use.
+	static int GetDepthFormatBytes(GLenum depthFormat);
+	static const char* GetDepthFormatName(GLenum depthFormat);
+
+	unsigned int GetNumTiles() const { return (unsigned int)_tileNodes.size(); }
+	unsigned int GetNumEvictions() const { return _numEvictions; }
+
+protected:
+
+	enum NodeState { NODE_FREE, NODE_SPLIT, NODE_USED };
+
+	// The quadtree is stored implicitly, the children of node n are 4n + 1 to 4n + 4
+	int FindNode(int node, int level, int targetLevel);
+	void FreeNode(int node);
+	bool EvictLeastRecentlyUsed();
+
+	// Creates a size x size depth texture and a framebuffer with it as the depth attachment
+	void CreateDepthTarget(GLenum internalFormat, GLuint& texture, GLuint& framebuffer);
+
+	int _size;
+	int _numLevels;
+	GLenum _depthFormat;
+	std::vector<unsigned char> _nodeState;
+	std::vector<unsigned char> _nodeLevel;
+	std::vector<int> _nodeX, _nodeY;
+
+	// Key and last frame used of every node that holds a tile
+	std::vector<unsigned int> _nodeKey;
+	std::vector<unsigned int> _nodeLastUsed;
+	std::vector<unsigned char> _nodeStaticCached;
+
+	// Node each key's tile lives in
+	std::unordered_map<unsigned int, int> _tileNodes;
+
+	unsigned int _frame;
+	unsigned int _numEvictions;
+
+	GLuint _texture;
+	GLuint _framebuffer;
+	GLuint _staticTexture;
+	GLuint _staticFramebuffer;
+	GLuint _compareSampler;
+};
+
+#endif
@@ -0,0 +1,202 @@
+
+#include "ShadowMoments.h"
+#include <iostream>
+
+ShadowMoments::ShadowMoments(int size, int minTileSize, int maxTileSize)
+	: _blurShader("vertFullscreenShader.txt", "fragMomentsBlurShader.txt"),
+	_downsampleShader("vertFullscreenShader.txt", "fragMomentsDownsampleShader.txt")
+{
+	_size = size;
+	_maxTileSize = maxTileSize;
+	_blurRadius = 2;
+
+	//Stop the mipmaps while the smallest tile is still 4 texels across, below that tiles would bleed into each other
+	_numLevels = 1;
+	while ((minTileSize >> _numLevels) >= 4)
+	{
+		_numLevels++;
+	}
+
+	//Nothing is allocated until the first tile is filtered
+	_texture = 0;
+	_tempTexture = 0;
+	_framebuffer = 0;
+	_tempFramebuffer = 0;
+	_emptyVAO = 0;
+
+	_blurRevision = 0;
+	_downsampleRevision = 0;
+}
+
+void ShadowMoments::Allocate()
+{
+	glGenTextures(1, &_texture);
+	glBindTexture(GL_TEXTURE_2D, _texture);
+	glTexStorage2D(GL_TEXTURE_2D, _numLevels, GL_RGBA16F, _size, _size);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	if (GLEW_EXT_texture_filter_anisotropic)
+	{
+		GLfloat maxAnisotropy = 1.0f;
+		glGetFloatv(GL_MAX_TEXTURE_MAX_ANISOTROPY_EXT, &maxAnisotropy);
+		glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAX_ANISOTROPY_EXT, maxAnisotropy < 16.0f ? maxAnisotropy : 16.0f);
+	}
+
+	glGenTextures(1, &_tempTexture);
+	glBindTexture(GL_TEXTURE_2D, _tempTexture);
+	glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGBA16F, _maxTileSize, _maxTileSize);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	glGenFramebuffers(1, &_framebuffer);
+	glBindFramebuffer(GL_FRAMEBUFFER, _framebuffer);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, _texture, 0);
+	if (GL_FRAMEBUFFER_COMPLETE != glCheckFramebufferStatus(GL_FRAMEBUFFER)) {
+		std::cerr << "ERROR: shadow moments frame buffer incomplete" << std::endl;
+	}
+
+	glGenFramebuffers(1, &_tempFramebuffer);
+	glBindFramebuffer(GL_FRAMEBUFFER, _tempFramebuffer);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, _tempTexture, 0);
+	if (GL_FRAMEBUFFER_COMPLETE != glCheckFramebufferStatus(GL_FRAMEBUFFER)) {
+		std::cerr << "ERROR: shadow moments blur frame buffer incomplete" << std::endl;
+	}
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+	glGenVertexArrays(1, &_emptyVAO);
+
+	std::cout << "INFO: shadow moments " << _size << "x" << _size << " with " << _numLevels << " mip levels allocated, " << GetMemoryBytes() << " bytes" << std::endl;
+}
+
+ShadowMoments::~ShadowMoments()
+{
+	glDeleteVertexArrays(1, &_emptyVAO);
+	glDeleteFramebuffers(1, &_framebuffer);
+	glDeleteFramebuffers(1, &_tempFramebuffer);
+	glDeleteTextures(1, &_texture);
+	glDeleteTextures(1, &_tempTexture);
+}
+
+size_t ShadowMoments::GetMemoryBytes() const
+{
+	//Four half floats a texel
+	size_t bytes = (size_t)_maxTileSize * _maxTileSize * 8;
+	for (int level = 0; level < _numLevels; level++)
+	{
+		size_t levelSize = (size_t)(_size >> level);
+		bytes += levelSize * levelSize * 8;
+	}
+	return bytes;
+}
+
+void ShadowMoments::FilterTile(GLuint depthTexture, int x, int y, int tileSize, float nearOverFar)
+{
+	if (tileSize > _maxTileSize)
+	{
+		std::cerr << "ERROR: shadow moments can't filter a " << tileSize << " tile, the largest is " << _maxTileSize << std::endl;
+		return;
+	}
+
+	if (!_texture)
+	{
+		Allocate();
+	}
+
+	//The handles are looked up again whenever the blur shader has been reloaded
+	if (_blurShader.getRevision() != _blurRevision)
+	{
+		_blurRevision = _blurShader.getRevision();
+		_sourceMap = _blurShader.getUniform<int>("sourceMap");
+		_sourceOffset = _blurShader.getUniform<glm::ivec2>("sourceOffset");
+		_targetOffset = _blurShader.getUniform<glm::ivec2>("targetOffset");
+		_direction = _blurShader.getUniform<glm::ivec2>("direction");
+		_tileSize = _blurShader.getUniform<int>("tileSize");
+		_radius = _blurShader.getUniform<int>("radius");
+		_warpDepth = _blurShader.getUniform<bool>("warpDepth");
+		_nearOverFar = _blurShader.getUniform<float>("nearOverFar");
+	}
+
+	_blurShader.use();
+	glBindVertexArray(_emptyVAO);
+	glActiveTexture(GL_TEXTURE0);
+	_sourceMap.set(0);
+	_tileSize.set(tileSize);
+	_radius.set(_blurRadius);
+	_nearOverFar.set(nearOverFar);
+
+	//Across, reading the depths straight out of the atlas and warping them, into the corner of the temporary texture
+	glBindFramebuffer(GL_FRAMEBUFFER, _tempFramebuffer);
+	glViewport(0, 0, tileSize, tileSize);
+	glBindTexture(GL_TEXTURE_2D, depthTexture);
+	_sourceOffset.set(glm::ivec2(x, y));
+	_targetOffset.set(glm::ivec2(0, 0));
+	_direction.set(glm::ivec2(1, 0));
+	_warpDepth.set(true);
+	glDrawArrays(GL_TRIANGLES, 0, 3);
+
+	//Then down, into the tile's place in the moments texture
+	glBindFramebuffer(GL_FRAMEBUFFER, _framebuffer);
+	glViewport(x, y, tileSize, tileSize);
+	glBindTexture(GL_TEXTURE_2D, _tempTexture);
+	_sourceOffset.set(glm::ivec2(0, 0));
+	_targetOffset.set(glm::ivec2(x, y));
+	_direction.set(glm::ivec2(0, 1));
+	_warpDepth.set(false);
+	glDrawArrays(GL_TRIANGLES, 0, 3);
+
+	glBindTexture(GL_TEXTURE_2D, 0);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glBindVertexArray(0);
+	glUseProgram(0);
+
+	_filteredTiles.push_back(glm::ivec3(x, y, tileSize));
+}
+
+void ShadowMoments::GenerateMipmaps()
+{
+	if (_filteredTiles.empty())
+	{
+		return;
+	}
+
+	if (_downsampleShader.getRevision() != _downsampleRevision)
+	{
+		_downsampleRevision = _downsampleShader.getRevision();
+		_downsampleSourceMap = _downsampleShader.getUniform<int>("sourceMap");
+	}
+
+	_downsampleShader.use();
+	glBindVertexArray(_emptyVAO);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, _texture);
+	_downsampleSourceMap.set(0);
+	glBindFramebuffer(GL_FRAMEBUFFER, _framebuffer);
+
+	//Tiles sit on multiples of their own size, so each one's corner and size halve cleanly all the way down
+	for (int level = 1; level < _numLevels; level++)
+	{
+		//Only the level above can be sampled, so drawing into this level isn't a feedback loop
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, level - 1);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, level - 1);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, _texture, level);
+		for (unsigned int i = 0; i < _filteredTiles.size(); i++)
+		{
+			const glm::ivec3& tile = _filteredTiles[i];
+			glViewport(tile.x >> level, tile.y >> level, tile.z >> level, tile.z >> level);
+			glDrawArrays(GL_TRIANGLES, 0, 3);
+		}
+	}
+	_filteredTiles.clear();
+
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, _numLevels - 1);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, _texture, 0);
+
+	glBindTexture(GL_TEXTURE_2D, 0);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glBindVertexArray(0);
+	glUseProgram(0);
+}
@@ -0,0 +1,79 @@
+#ifndef __SHADOWMOMENTS_H__
+#define __SHADOWMOMENTS_H__
+
+#include "glew.h"
+#include "Shader.h"
+#include <vector>
+
+// Exponential variance shadow maps for the tiles of a ShadowAtlas
+// A tile's depths are warped into four moments, blurred with a separable Gaussian and mipmapped into a texture laid out like the atlas,
+// so the lit shader can soft-shadow a point with one filtered fetch however wide the blur is
+// The textures are only allocated the first time a tile is filtered, so they cost nothing while EVSM isn't used
+class ShadowMoments
+{
+public:
+	// size is the atlas size, minTileSize and maxTileSize the smallest and largest tiles it hands out
+	ShadowMoments(int size, int minTileSize, int maxTileSize);
+	~ShadowMoments();
+
+	// Radius of the Gaussian in texels, each blur pass reads 2 * radius + 1 texels per texel
+	void SetBlurRadius(int radius) { _blurRadius = radius; }
+	int GetBlurRadius() const { return _blurRadius; }
+
+	// Warps and blurs the tile of the depth texture at (x, y) into the same place in the moments texture
+	// nearOverFar is the near plane over the far plane of a perspective tile, the moments are of its depths turned back into linear distances
+	// Leave it 0 for an orthographic tile, its depths are linear already
+	// Filter every tile that was redrawn this frame, then call GenerateMipmaps once
+	void FilterTile(GLuint depthTexture, int x, int y, int tileSize, float nearOverFar = 0.0f);
+
+	// Box filters the tiles filtered since the last call down through the mip levels, the rest of the texture is left alone
+	void GenerateMipmaps();
+
+	// 0 until the first tile is filtered
+	GLuint GetTexture() const { return _texture; }
+
+	// Bytes of video memory the moments texture with its mipmaps and the blur's temporary texture take together, once they are allocated
+	size_t GetMemoryBytes() const;
+	bool IsAllocated() const { return _texture != 0; }
+
+protected:
+
+	void Allocate();
+
+	int _size;
+	int _maxTileSize;
+	int _numLevels;
+	int _blurRadius;
+
+	// Four 16 bit float moments per texel, mipmapped down until the smallest tile is a few texels across
+	GLuint _texture;
+	GLuint _framebuffer;
+
+	// The first pass blurs across into here, the second blurs down from here into the tile
+	GLuint _tempTexture;
+	GLuint _tempFramebuffer;
+
+	// The passes draw one triangle over the viewport, its corners come from gl_VertexID so there are no vertex buffers
+	GLuint _emptyVAO;
+
+	Shader _blurShader;
+	unsigned int _blurRevision;
+	Uniform<int> _sourceMap;
+	Uniform<glm::ivec2> _sourceOffset;
+	Uniform<glm::ivec2> _targetOffset;
+	Uniform<glm::ivec2> _direction;
+	Uniform<int> _tileSize;
+	Uniform<int> _radius;
+	Uniform<bool> _warpDepth;
+	Uniform<float> _nearOverFar;
+
+	// Tiles filtered since the last GenerateMipmaps, x, y and size in the top level
+	std::vector<glm::ivec3> _filteredTiles;
+
+	// Draws each of those tiles into the next level from the one above it
+	Shader _downsampleShader;
+	unsigned int _downsampleRevision;
+	Uniform<int> _downsampleSourceMap;
+};
+
+#endif
@@ -180,6 +180,17 @@ Cube::Cube()
 
 	// Technically we can do this, because the enabled / disabled state is stored in the VAO
 	glDisableVertexAttribArray(0);
+
+	//A second VAO over the same position buffer with only attribute 0 enabled
+	//Depth passes draw with it so the GPU fetches 12 bytes a vertex and none of the normals
+	_positionVAO = 0;
+	glGenVertexArrays(1, &_positionVAO);
+	glBindVertexArray(_positionVAO);
+	glBindBuffer(GL_ARRAY_BUFFER, buffer);
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, 0);
+	glEnableVertexAttribArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindVertexArray(0);
 	
 
 }
@@ -187,6 +198,7 @@ Cube::Cube()
 Cube::~Cube()
 {
 	glDeleteVertexArrays( 1, &_VAO );
+	glDeleteVertexArrays( 1, &_positionVAO );
 	// TODO: delete the VBOs as well!
 }
 
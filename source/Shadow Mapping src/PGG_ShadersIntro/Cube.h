@@ -15,8 +15,15 @@ public:
 
 	void Draw();
 
+	// Mesh data for callers that submit their own draws, like ObjectTable
+	GLuint GetVAO() const { return _VAO; }
+	// Reads the positions alone, for depth passes that have no use for the rest of the vertex
+	GLuint GetPositionVAO() const { return _positionVAO; }
+	unsigned int GetNumVertices() const { return _numVertices; }
+
 protected:
 	GLuint _VAO;
+	GLuint _positionVAO;
 	unsigned int _numVertices;
 
 
@@ -10,11 +10,16 @@
 #include "glew.h"
 #include "Scene.h"
 #include "Shader.h"
+#include "ShadowAtlas.h"
+#include "ShadowMoments.h"
+#include "ShaderLibrary.h"
 
 // iostream is so we can output error messages to console
 #include <iostream>
 #include <string>
 #include <chrono>
+#include <cstring>
+#include <cstdlib>
 
 GLenum glCheckError_(const char* file, int line)
 {
@@ -38,6 +43,31 @@ GLenum glCheckError_(const char* file, int line)
 }
 
 
+//KHR_parallel_shader_compile is newer than this GLEW, so its entry point is looked up by hand
+#define GL_MAX_SHADER_COMPILER_THREADS_KHR 0x91B0
+typedef void (GLAPIENTRY *PFNGLMAXSHADERCOMPILERTHREADSKHRPROC)(GLuint count);
+
+//Whether the context has the extension, GLEW 1.11 doesn't know about every extension it might
+bool HasGLExtension(const char* name)
+{
+	GLint numExtensions = 0;
+	glGetIntegerv(GL_NUM_EXTENSIONS, &numExtensions);
+	for (GLint i = 0; i < numExtensions; i++)
+	{
+		if (strcmp((const char*)glGetStringi(GL_EXTENSIONS, i), name) == 0)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+//Milliseconds between two points of the startup
+long long ElapsedMs(std::chrono::steady_clock::time_point from, std::chrono::steady_clock::time_point to)
+{
+	return (long long)std::chrono::duration_cast<std::chrono::milliseconds>(to - from).count();
+}
+
 // An initialisation function, mainly for GLEW
 // This will also print to console the version of OpenGL we are using
 bool InitGL()
@@ -60,6 +90,17 @@ bool InitGL()
 	std::cout<<"INFO: OpenGL Renderer: "<< glGetString( GL_RENDERER ) << std::endl;
 	std::cout<<"INFO: OpenGL Version: "<< glGetString( GL_VERSION ) << std::endl;
 	std::cout<<"INFO: OpenGL Shading Language Version: "<< glGetString( GL_SHADING_LANGUAGE_VERSION ) << std::endl;
+
+	//Let the driver compile on as many threads as it likes, so the shaders submitted at startup build side by side and in the background
+	if (HasGLExtension("GL_KHR_parallel_shader_compile"))
+	{
+		PFNGLMAXSHADERCOMPILERTHREADSKHRPROC glMaxShaderCompilerThreadsKHR = (PFNGLMAXSHADERCOMPILERTHREADSKHRPROC)SDL_GL_GetProcAddress("glMaxShaderCompilerThreadsKHR");
+		if (glMaxShaderCompilerThreadsKHR)
+		{
+			glMaxShaderCompilerThreadsKHR(0xFFFFFFFF);
+			std::cout<<"INFO: Parallel shader compile enabled"<<std::endl;
+		}
+	}
 	
 	return true;
 }
@@ -68,7 +109,7 @@ bool InitGL()
 int main(int argc, char *argv[])
 {
 	//Get time
-	std::chrono::steady_clock::time_point time1 = std::chrono::high_resolution_clock::now();
+	std::chrono::steady_clock::time_point time1 = std::chrono::steady_clock::now();
 
 	// This is our initialisation phase
 
@@ -154,6 +195,17 @@ int main(int argc, char *argv[])
 		return -1;
 	}
 
+	//Linked programs are kept between runs in the user's app data folder, so only the first run has to compile them
+	char* shaderCachePath = SDL_GetPrefPath("PGG_ShadersIntro", "ShadowMappingShaderCache");
+	if (shaderCachePath)
+	{
+		Shader::SetBinaryCacheDirectory(shaderCachePath);
+		SDL_free(shaderCachePath);
+	}
+
+	//Shader files edited while it runs are rebuilt in the background, see Shader::StartReloadThread
+	Shader::StartReloadThread(window);
+
 
 	
 	// We are going to work out how much time passes from frame to frame
@@ -167,49 +219,72 @@ int main(int argc, char *argv[])
 	glEnable(GL_DEPTH_TEST);
 
 	//Shaders
-	Shader depthShader("vertDepthShader.txt", "fragDepthShader.txt");
-	Shader defaultShader("vertShader.txt", "fragShader.txt");
+	//Every program is submitted up front and only waited for once the rest of the startup is done, so they compile alongside it
+	std::chrono::steady_clock::time_point shadersStart = std::chrono::steady_clock::now();
+	//The depth pass only needs the depths the rasterizer writes, so it has no fragment shader
+	Shader depthShader("vertDepthShader.txt", nullptr);
+	//The lit shader is compiled once for every shadow variant that gets used, the variant is its feature mask
+	ShaderLibrary shaderLibrary;
+	unsigned int litProgram = shaderLibrary.AddProgram("vertShader.txt", "fragShader.txt", ShadowVariant::GetFeatureDefines);
+
+	//The variant the scene starts with
+	ShadowVariant startVariant;
+	Shader& startLitShader = shaderLibrary.Get(litProgram, startVariant.GetFeatures());
+	std::chrono::steady_clock::time_point shadersSubmitted = std::chrono::steady_clock::now();
 
 	////////////////////////////////////////////////////////////////////
-	const unsigned int SHADOW_WIDTH = 640, SHADOW_HEIGHT = 640;
-
-	//Create framebuffer object for rendering depth map
-	unsigned int depthMapFBO;
-	glGenFramebuffers(1, &depthMapFBO);
-
-	//Create the depth texture
-	unsigned int depthMap;
-	glGenTextures(1, &depthMap);
-	glBindTexture(GL_TEXTURE_2D, depthMap);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT16, SHADOW_WIDTH, SHADOW_HEIGHT, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-
-	//Attach depth texture as FBO's depth buffer
-	glBindFramebuffer(GL_FRAMEBUFFER, depthMapFBO);
-	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depthMap, 0);
-	glDrawBuffer(GL_NONE);
-	glReadBuffer(GL_NONE);
-	
+	//The light's shadow map is a tile of one shadow atlas.
+	//The atlas size and depth format are the whole shadow memory budget (twice over, with the static copies), however many shadow maps end up in it.
+	//The cascades are fitted to the scene, so a small atlas covers it at the same texel density, and their depth ranges too, so 16 bits of depth is enough.
+	//GL_DEPTH_COMPONENT24 and GL_DEPTH_COMPONENT32F cost twice the memory for the precision a much deeper scene would need.
+	//The four cascade tiles fill the atlas exactly, two across and two down, so none of it is allocated for nothing.
+	static_assert(Scene::NUM_CASCADES == 4, "the shadow atlas is sized for four cascade tiles");
+	const int SHADOW_ATLAS_SIZE = 2 * Scene::CASCADE_TILE_SIZE, SHADOW_MIN_TILE_SIZE = 64;
+	const GLenum SHADOW_DEPTH_FORMAT = GL_DEPTH_COMPONENT16;
+	ShadowAtlas shadowAtlas(SHADOW_ATLAS_SIZE, SHADOW_MIN_TILE_SIZE, SHADOW_DEPTH_FORMAT);
+
+	//Blurred moments of every tile for EVSM, laid out like the atlas. Four half floats and the mipmaps make it around 3MB. It is only allocated once EVSM is first used.
+	//Its blur target only has to fit a cascade's tile
+	const int SHADOW_MAX_TILE_SIZE = Scene::CASCADE_TILE_SIZE;
+	ShadowMoments shadowMoments(SHADOW_ATLAS_SIZE, SHADOW_MIN_TILE_SIZE, SHADOW_MAX_TILE_SIZE);
+	std::cout << "INFO: shadow memory " << shadowAtlas.GetMemoryBytes() << " bytes atlas and static copy, EVSM adds " << shadowMoments.GetMemoryBytes()
+		<< " bytes moments and blur target once it is used" << std::endl;
+	std::chrono::steady_clock::time_point texturesCreated = std::chrono::steady_clock::now();
+
+	/////////////////////////////////////////////////////////////////////////
+
+	Scene myScene;
+	myScene.SetShadowVariant(startVariant);
 
-	if (GL_FRAMEBUFFER_COMPLETE == glCheckFramebufferStatus(GL_FRAMEBUFFER)) {
-		std::cout << ("INFO: frame buffer success") << std::endl;
+	//Run with -cubes N to add a field of N static cubes, every pass should still draw all of them with its one multi-draw call
+	unsigned int cubeFieldSize = 0;
+	for (int i = 1; i + 1 < argc; i++)
+	{
+		if (strcmp(argv[i], "-cubes") == 0)
+		{
+			cubeFieldSize = (unsigned int)strtoul(argv[i + 1], NULL, 10);
+		}
 	}
-	else {
-		std::cout << ("frame buffer fail");
+	if (cubeFieldSize > 0)
+	{
+		myScene.AddCubeField(cubeFieldSize);
+		std::cout << "INFO: added a field of " << cubeFieldSize << " cubes, the scene has " << myScene.GetNumObjects() << " objects" << std::endl;
 	}
-	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	std::chrono::steady_clock::time_point sceneCreated = std::chrono::steady_clock::now();
 
-	/////////////////////////////////////////////////////////////////////////
+	//Whatever compile time didn't fit behind the rest of the startup is waited for here
+	depthShader.finish();
+	startLitShader.finish();
+	std::chrono::steady_clock::time_point shadersFinished = std::chrono::steady_clock::now();
 
-	Scene myScene;
+	std::cout << "INFO: Startup " << ElapsedMs(time1, shadersStart) << "ms window and GL, " << ElapsedMs(shadersStart, shadersSubmitted) << "ms submitting shaders, "
+		<< ElapsedMs(shadersSubmitted, texturesCreated) << "ms shadow textures, " << ElapsedMs(texturesCreated, sceneCreated) << "ms scene, "
+		<< ElapsedMs(sceneCreated, shadersFinished) << "ms waiting for shaders" << std::endl;
 
 	glEnable(GL_DEPTH_TEST);
 
 	//Calculate how long the SDL initalisation took, setting models, etc.
-	std::chrono::steady_clock::time_point time2 = std::chrono::high_resolution_clock::now();
+	std::chrono::steady_clock::time_point time2 = std::chrono::steady_clock::now();
 	std::chrono::milliseconds milliseconds = std::chrono::duration_cast<std::chrono::milliseconds>(time2 - time1);
 
 	std::cout << "Time taken: " << milliseconds.count() << std::endl;
@@ -236,9 +311,18 @@ int main(int argc, char *argv[])
 	//   * Draw our world
 	// We will come back to this in later lectures
 
+	//With a cube field the first frame's lit pass is counted, every object has to come out of the one call
+	GLuint cubeFieldQuery = 0;
+	if (cubeFieldSize > 0)
+	{
+		glGenQueries(1, &cubeFieldQuery);
+	}
+
 	bool go = true;
 	while( go )
 	{
+		//Swap in the programs whose source files were edited, before anything this frame is drawn with them
+		Shader::ReloadChangedSources();
 
 		// Here we are going to check for any input events
 		// Basically when you press the keyboard or move the mouse, the parameters are stored as something called an 'event'
@@ -246,6 +330,10 @@ int main(int argc, char *argv[])
 		// We need to check for each event and then do something about it (called 'event handling')
 		// the SDL_Event is the datatype for the event
 		SDL_Event incomingEvent;
+
+		//The shadow keys edit a copy of the scene's variant and hand it back
+		ShadowVariant shadowVariant;
+
 		// SDL_PollEvent will check if there is an event in the queue
 		// If there's nothing in the queue it won't sit and wait around for an event to come along (there are functions which do this, and that can be useful too!)
 		// For an empty queue it will simply return 'false'
@@ -291,6 +379,30 @@ int main(int argc, char *argv[])
 					break;
 				case SDLK_s:
 					break;
+				case SDLK_v:
+					//Switch between PCF and EVSM shadows
+					shadowVariant = myScene.GetShadowVariant();
+					shadowVariant.technique = shadowVariant.technique == ShadowVariant::TECHNIQUE_PCF ? ShadowVariant::TECHNIQUE_EVSM : ShadowVariant::TECHNIQUE_PCF;
+					myScene.SetShadowVariant(shadowVariant);
+					break;
+				case SDLK_k:
+					//Go round the PCF kernel sizes, 3x3, 5x5 and 7x7
+					shadowVariant = myScene.GetShadowVariant();
+					shadowVariant.kernelSize = shadowVariant.kernelSize == 7 ? 3 : shadowVariant.kernelSize + 2;
+					myScene.SetShadowVariant(shadowVariant);
+					break;
+				case SDLK_p:
+					//Go round the PCF sample patterns, grid, Poisson and rotated Poisson
+					shadowVariant = myScene.GetShadowVariant();
+					shadowVariant.pattern = (ShadowVariant::SamplePattern)((shadowVariant.pattern + 1) % ShadowVariant::NUM_PATTERNS);
+					myScene.SetShadowVariant(shadowVariant);
+					break;
+				case SDLK_b:
+					//Switch between constant and slope scaled bias
+					shadowVariant = myScene.GetShadowVariant();
+					shadowVariant.bias = (ShadowVariant::BiasModel)((shadowVariant.bias + 1) % ShadowVariant::NUM_BIAS_MODELS);
+					myScene.SetShadowVariant(shadowVariant);
+					break;
 				}
 				break;
 			
@@ -338,16 +450,19 @@ int main(int argc, char *argv[])
 		lastTime = current;
 		
 		myScene.Update( deltaTs );
+
+		//Hand out this frame's shadow tiles, then upload the camera and light data once, both passes read it from the uniform buffer
+		shadowAtlas.BeginFrame();
+		myScene.UpdateUniformBuffers(shadowAtlas);
 	
 	
 
 		//Draw our world
 
-		//1. Generate the depth map
-		glBindFramebuffer(GL_FRAMEBUFFER, depthMapFBO);
-		glViewport(0, 0, SHADOW_WIDTH, SHADOW_HEIGHT);
-		glClear(GL_DEPTH_BUFFER_BIT);
-		myScene.Draw(depthShader);
+		//1. Generate the depth map, the scene binds the atlas framebuffers itself
+		glViewport(0, 0, SHADOW_ATLAS_SIZE, SHADOW_ATLAS_SIZE);
+		myScene.DrawShadowCasters(depthShader, shadowAtlas);
+		myScene.FilterShadowMoments(shadowMoments, shadowAtlas);
 		glBindFramebuffer(GL_FRAMEBUFFER, 0);
 		
 		//2. Render scene as normal with shadow mapping.
@@ -360,9 +475,35 @@ int main(int argc, char *argv[])
 		glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
 		
 		//Draw second scene with normal shaders
-		//If you want to see the depth shader change the "mySceneDraw.(defaultShader)" to "mySceneDraw.(depthShader)"
-		glBindTexture(GL_TEXTURE_2D, depthMap);
-		myScene.Draw(defaultShader);
+		//If you want to see the depth shader change the lit shader passed to "myScene.Draw" to "depthShader"
+		glActiveTexture(GL_TEXTURE1);
+		glBindTexture(GL_TEXTURE_2D, shadowMoments.GetTexture());
+		glActiveTexture(GL_TEXTURE0);
+		glBindTexture(GL_TEXTURE_2D, shadowAtlas.GetTexture());
+		glBindSampler(0, shadowAtlas.GetCompareSampler());
+		if (cubeFieldQuery)
+		{
+			glBeginQuery(GL_PRIMITIVES_GENERATED, cubeFieldQuery);
+		}
+		myScene.Draw(shaderLibrary.Get(litProgram, myScene.GetShadowVariant().GetFeatures()));
+		if (cubeFieldQuery)
+		{
+			//Waits for the GPU, but only the once
+			glEndQuery(GL_PRIMITIVES_GENERATED);
+			GLuint triangles = 0;
+			glGetQueryObjectuiv(cubeFieldQuery, GL_QUERY_RESULT, &triangles);
+			if (triangles == myScene.GetNumObjectTriangles())
+			{
+				std::cout << "INFO: lit pass drew " << triangles << " triangles, all " << myScene.GetNumObjects() << " objects" << std::endl;
+			}
+			else
+			{
+				std::cerr << "ERROR: lit pass drew " << triangles << " triangles, " << myScene.GetNumObjects() << " objects should make " << myScene.GetNumObjectTriangles() << std::endl;
+			}
+			glDeleteQueries(1, &cubeFieldQuery);
+			cubeFieldQuery = 0;
+		}
+		glBindSampler(0, 0);
 
 
 
@@ -388,6 +529,7 @@ int main(int argc, char *argv[])
 			//Set string to FPS
 			ss.str(std::string());
 			ss << "FPS: " << fps_frames;
+			ss << " | " << myScene.GetShadowVariant().GetName() << " (" << shaderLibrary.GetNumPermutations(litProgram) << " compiled)";
 
 			//Input FPS into a txt file
 			std::ofstream fpsFile;
@@ -417,6 +559,7 @@ int main(int argc, char *argv[])
 
 
 	// Our cleanup phase, hopefully fairly self-explanatory ;)
+	Shader::StopReloadThread();
 	SDL_GL_DeleteContext( glcontext );
 	SDL_DestroyWindow( window );
 	SDL_Quit();
@@ -2,9 +2,12 @@
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <cstring>
 
 #include "Scene.h"
 #include "Shader.h"
+#include <cmath>
+#include <cfloat>
 
 Scene::Scene()
 {
@@ -19,6 +22,30 @@ Scene::Scene()
 	//_modelMatrixCube1;
 	_modelMatrixCube2 = glm::scale(glm::translate(glm::mat4(1.0f),glm::vec3(1.0f,0.0f,0.0f)),glm::vec3(0.1f,0.1f,0.1f));
 	_modelMatrixCube3 = glm::scale(glm::translate(glm::mat4(1.0f),glm::vec3(0.0f,-1.0f,0.0f)),glm::vec3(2.0f,0.1f,2.0f));
+
+	//Register the cubes with the object table, every one of them is drawn with the cube mesh
+	_objects.SetMesh(_cubeModel.GetVAO(), _cubeModel.GetPositionVAO(), _cubeModel.GetNumVertices());
+
+	/* Cube 1 */
+	_cube1Object = _objects.AddObject(_objects.AddMaterial(glm::vec3(1.0f, 0.3f, 0.3f), glm::vec3(0.0f, 0.0f, 0.0f)));
+
+	/* Cube 2 */
+	// Emissive colour for cube 2 is bright so it looks like a light
+	_cube2Object = _objects.AddObject(_objects.AddMaterial(glm::vec3(0.0f, 0.0f, 0.0f), glm::vec3(1.0f, 1.0f, 1.0f)));
+
+	/* Cube 3 */
+	_cube3Object = _objects.AddObject(_objects.AddMaterial(glm::vec3(0.3f, 0.3f, 1.0f), glm::vec3(0.0f, 0.0f, 0.0f)));
+	SetCubeTransform(_cube3Object, _modelMatrixCube3);
+	if (_cube1Object == ObjectTable::INVALID_ID || _cube2Object == ObjectTable::INVALID_ID || _cube3Object == ObjectTable::INVALID_ID)
+	{
+		std::cerr << "ERROR: Scene could not add every cube to the object table" << std::endl;
+	}
+
+	//The floor never moves, so its shadow is drawn once and cached in the atlas
+	if (_cube3Object != ObjectTable::INVALID_ID)
+	{
+		_objects.SetStatic(_cube3Object, true);
+	}
 	
 	// Set up the viewing matrix
 	// This represents the camera's orientation and position
@@ -26,27 +53,46 @@ Scene::Scene()
 	
 
 	// Set up a projection matrix
-	_projMatrix = glm::perspective(45.0f, 1.0f, 0.1f, 10.0f);
+	_cameraNearPlane = 0.1f, _cameraFarPlane = 10.0f;
+	_projMatrix = glm::perspective(45.0f, 1.0f, _cameraNearPlane, _cameraFarPlane);
 
 
 	//Setting up light matrix
 	near_plane = 0.1f, far_plane = 10.0f;
 	lightPos = glm::vec3(-1.0f, 4.0f, 1.0f);
-	lightProjection = glm::ortho(-10.0f, 10.0f, -10.0f, 10.0f, near_plane, far_plane);
 	lightView = glm::lookAt
 				(lightPos,                           
 				glm::vec3(0.0f, 0.0f, 0.0f),
 				glm::vec3(0.0f, 1.0f, 0.0f));
-	lightModelMatrix = glm::mat4(1.0f);
-
-	//The Light Space Matrix.
-	lightSpaceMatrix = lightModelMatrix * lightProjection * lightView;
-
 
+	//The cascade projections are fitted to the camera every frame, see UpdateCascades
+	_cascadeSplitLambda = 0.5f;
+	_sceneBoundsMin = glm::vec3(0.0f), _sceneBoundsMax = glm::vec3(0.0f);
+	_lightSpaceBoundsMin = glm::vec3(0.0f), _lightSpaceBoundsMax = glm::vec3(0.0f);
+	for (int i = 0; i < NUM_CASCADES; i++)
+	{
+		cascadeTiles[i] = glm::vec4(0.0f);
+		cascadeAtlasTiles[i] = -1;
+	}
+	_staticVersion = _objects.GetStaticVersion();
+
+	//Create the uniform buffer shared by every shader program
+	//The light block has to start on the driver's offset alignment so it can be bound with glBindBufferRange
+	GLint alignment = 256;
+	glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+	_lightBlockOffset = ((sizeof(FrameUniformData) + alignment - 1) / alignment) * alignment;
+	_uniformBufferSize = _lightBlockOffset + sizeof(LightUniformData);
+	_uniformStaging.resize(_uniformBufferSize);
+
+	glGenBuffers(1, &_uniformBuffer);
+	glBindBuffer(GL_UNIFORM_BUFFER, _uniformBuffer);
+	glBufferData(GL_UNIFORM_BUFFER, _uniformBufferSize, NULL, GL_DYNAMIC_DRAW);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
 }
 
 Scene::~Scene()
 {
+	glDeleteBuffers(1, &_uniformBuffer);
 }
 
 void Scene::Update( float deltaTs )
@@ -73,65 +119,341 @@ void Scene::Update( float deltaTs )
 	_modelMatrixCube2 = glm::scale(glm::translate(glm::rotate( glm::mat4(1.0f),-_cube2Angle, glm::vec3(0,1,0) ),glm::vec3(1.0f,0.0f,0.0f)),glm::vec3(0.1f,0.1f,0.1f));
 
 	_viewMatrix = glm::rotate( glm::rotate( glm::translate( glm::mat4(1.0f), glm::vec3(0,0,-3.5f) ), _cameraAngleX, glm::vec3(1,0,0) ), _cameraAngleY, glm::vec3(0,1,0) );
+
+	// Write this frame's transforms to the object table, both the depth pass and the lit pass draw from it
+	SetCubeTransform(_cube1Object, _modelMatrixCube1);
+	SetCubeTransform(_cube2Object, _modelMatrixCube2);
+	SetCubeTransform(_cube3Object, _modelMatrixCube3);
+	_objects.Upload();
 }
 
-void Scene::Draw(Shader shader)
+void Scene::SetCubeTransform(unsigned int object, const glm::mat4& modelMat)
 {
-		// Activate the shader program
-		//glUseProgram( _shaderProgram );
+	if (object != ObjectTable::INVALID_ID)
+	{
+		_objects.SetTransform(object, modelMat);
+	}
+}
 
-		shader.use();
-	
-		// We use the small cube's model matrix to transform the light position
-		// This means the light will have the position of the small cube
-		shader.setVec4("worldSpaceLightPos", _modelMatrixCube2 * glm::vec4(0, 0, 0, 1) );
+void Scene::AddCubeField(unsigned int count)
+{
+	//Room for the whole field up front, so the object buffers are only reallocated once
+	_objects.Reserve(_objects.GetNumObjects() + count);
+	unsigned int material = _objects.AddMaterial(glm::vec3(0.6f, 0.6f, 0.6f), glm::vec3(0.0f, 0.0f, 0.0f));
+	if (material == ObjectTable::INVALID_ID)
+	{
+		return;
+	}
 
+	//The floor is 2 units square with its top at -0.95, each cube sits on it a little smaller than its cell
+	unsigned int side = (unsigned int)ceil(sqrt((double)count));
+	float cellSize = 2.0f / (float)side;
+	for (unsigned int i = 0; i < count; i++)
+	{
+		glm::vec3 position(-1.0f + cellSize * ((float)(i % side) + 0.5f), -0.95f + cellSize * 0.4f, -1.0f + cellSize * ((float)(i / side) + 0.5f));
+		unsigned int object = _objects.AddObject(material);
+		if (object == ObjectTable::INVALID_ID)
+		{
+			//The table is full, AddObject has said so already
+			break;
+		}
+		_objects.SetTransform(object, glm::scale(glm::translate(glm::mat4(1.0f), position), glm::vec3(cellSize * 0.8f)));
+		_objects.SetStatic(object, true);
+	}
+}
 
-		// Send view and projection matrices to OpenGL
-		shader.setMat4("viewMat", _viewMatrix);
-		shader.setMat4("projMat", _projMatrix);
-		shader.setMat4("lightSpaceMatrix", lightSpaceMatrix);
-		shader.setFloat("far_plane", far_plane);
-		shader.setFloat("near_plane", near_plane);
-		shader.setFloat("depthMap", 0);
+void Scene::UpdateUniformBuffers(ShadowAtlas& shadowAtlas)
+{
+	//Every cascade keeps its tile from frame to frame, a zero scale turns that cascade's shadow off if the atlas has no room
+	for (int i = 0; i < NUM_CASCADES; i++)
+	{
+		int tile = shadowAtlas.AcquireTile(i, CASCADE_TILE_SIZE);
+		cascadeAtlasTiles[i] = tile;
+		cascadeTiles[i] = tile >= 0 ? shadowAtlas.GetTileScaleOffset(tile) : glm::vec4(0.0f);
+	}
+	UpdateSceneBounds();
+	UpdateCascades();
+	UpdateStaticCache(shadowAtlas);
+
+	//Camera data
+	FrameUniformData frameData;
+	frameData.viewMat = _viewMatrix;
+	frameData.projMat = _projMatrix;
+	// We use the small cube's model matrix to transform the light position
+	// This means the light will have the position of the small cube
+	frameData.worldSpaceLightPos = _modelMatrixCube2 * glm::vec4(0, 0, 0, 1);
+
+	//Light data
+	LightUniformData lightData;
+	for (int i = 0; i < NUM_CASCADES; i++)
+	{
+		lightData.cascadeMatrices[i] = cascadeMatrices[i];
+		lightData.cascadeTiles[i] = cascadeTiles[i];
+		lightData.cascadeSplits[i] = cascadeSplits[i];
+	}
+	lightData.nearPlane = near_plane;
+	lightData.farPlane = far_plane;
 
+	memcpy(&_uniformStaging[0], &frameData, sizeof(frameData));
+	memcpy(&_uniformStaging[_lightBlockOffset], &lightData, sizeof(lightData));
 
-		/* Draw Cube 1 */
+	//One upload for the whole frame, then every program reads it through the binding points
+	glBindBuffer(GL_UNIFORM_BUFFER, _uniformBuffer);
+	glBufferSubData(GL_UNIFORM_BUFFER, 0, _uniformBufferSize, &_uniformStaging[0]);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
 
-			// Set emissive colour component for cube 1
-			shader.setVec3("emissiveColour", 0.0f, 0.0f, 0.0f);
-			shader.setMat4("modelMat", _modelMatrixCube1);
-			// Set diffuse colour for cube 1
-			shader.setVec3("diffuseColour", 1.0f, 0.3f, 0.3f);
-				_cubeModel.Draw( );
+	glBindBufferRange(GL_UNIFORM_BUFFER, FRAME_UBO_BINDING, _uniformBuffer, 0, sizeof(FrameUniformData));
+	glBindBufferRange(GL_UNIFORM_BUFFER, LIGHT_UBO_BINDING, _uniformBuffer, _lightBlockOffset, sizeof(LightUniformData));
+}
 
-		
+bool Scene::UpdateSceneBounds()
+{
+	//Every object is a unit cube
+	glm::vec3 boundsMin, boundsMax;
+	_objects.GetBounds(glm::vec3(-0.5f), glm::vec3(0.5f), boundsMin, boundsMax);
+
+	//Round out to a quarter unit
+	boundsMin = glm::floor(boundsMin * 4.0f) / 4.0f;
+	boundsMax = glm::ceil(boundsMax * 4.0f) / 4.0f;
+
+	//Grow the old bounds to take everything in, so objects moving about inside the scene leave the cascades, and the static copies drawn with them, alone
+	//They are only fitted afresh once that would leave them more than a unit too big on some side
+	glm::vec3 grownMin = glm::min(boundsMin, _sceneBoundsMin), grownMax = glm::max(boundsMax, _sceneBoundsMax);
+	if (glm::all(glm::lessThanEqual(boundsMin - grownMin, glm::vec3(1.0f))) && glm::all(glm::lessThanEqual(grownMax - boundsMax, glm::vec3(1.0f))))
+	{
+		boundsMin = grownMin, boundsMax = grownMax;
+	}
 
-		/* Draw Cube 2 */
+	if (boundsMin == _sceneBoundsMin && boundsMax == _sceneBoundsMax)
+	{
+		return false;
+	}
+	_sceneBoundsMin = boundsMin, _sceneBoundsMax = boundsMax;
 
-			
-			shader.setMat4("modelMat", _modelMatrixCube2);
-			shader.setVec3("diffuseColour", 0.0f, 0.0f, 0.0f);
-			// Set emissive colour component for cubes 2 to be bright so it looks like a light
-			shader.setVec3("emissiveColour", 1.0f, 1.0f, 1.0f );
-				_cubeModel.Draw( );
-		
+	//Box around the scene bounds' corners in light view space
+	_lightSpaceBoundsMin = glm::vec3(FLT_MAX), _lightSpaceBoundsMax = glm::vec3(-FLT_MAX);
+	for (int i = 0; i < 8; i++)
+	{
+		glm::vec3 corner((i & 1) ? boundsMax.x : boundsMin.x, (i & 2) ? boundsMax.y : boundsMin.y, (i & 4) ? boundsMax.z : boundsMin.z);
+		glm::vec3 lightSpaceCorner = glm::vec3(lightView * glm::vec4(corner, 1.0f));
+		_lightSpaceBoundsMin = glm::min(_lightSpaceBoundsMin, lightSpaceCorner);
+		_lightSpaceBoundsMax = glm::max(_lightSpaceBoundsMax, lightSpaceCorner);
+	}
 
+	//The depth range only has to cover the scene, so every bit of it lands on real geometry
+	near_plane = -_lightSpaceBoundsMax.z, far_plane = -_lightSpaceBoundsMin.z;
+	return true;
+}
 
-		/* Draw Cube 3 */
+void Scene::UpdateCascades()
+{
+	//The corners of the camera frustum in world space, near plane then far plane
+	glm::mat4 inverseViewProj = glm::inverse(_projMatrix * _viewMatrix);
+	glm::vec3 nearCorners[4], farCorners[4];
+	for (int i = 0; i < 4; i++)
+	{
+		glm::vec4 nearCorner = inverseViewProj * glm::vec4((i & 1) ? 1.0f : -1.0f, (i & 2) ? 1.0f : -1.0f, -1.0f, 1.0f);
+		glm::vec4 farCorner = inverseViewProj * glm::vec4((i & 1) ? 1.0f : -1.0f, (i & 2) ? 1.0f : -1.0f, 1.0f, 1.0f);
+		nearCorners[i] = glm::vec3(nearCorner) / nearCorner.w;
+		farCorners[i] = glm::vec3(farCorner) / farCorner.w;
+	}
 
-			// Set emissive colour component for cubes 3 to be dark
-			shader.setVec3("emissiveColour", 0.0f, 0.0f, 0.0f );
-			shader.setMat4("modelMat", _modelMatrixCube3);
-			// Set diffuse colour for cube 3
-			shader.setVec3("diffuseColour", 0.3f, 0.3f, 1.0f );
-				_cubeModel.Draw( );
+	float sliceNear = _cameraNearPlane;
+	for (int cascade = 0; cascade < NUM_CASCADES; cascade++)
+	{
+		//Practical split scheme, a blend of logarithmic and uniform split distances
+		float fraction = (float)(cascade + 1) / (float)NUM_CASCADES;
+		float logSplit = _cameraNearPlane * pow(_cameraFarPlane / _cameraNearPlane, fraction);
+		float uniformSplit = _cameraNearPlane + (_cameraFarPlane - _cameraNearPlane) * fraction;
+		float sliceFar = _cascadeSplitLambda * logSplit + (1.0f - _cascadeSplitLambda) * uniformSplit;
+		cascadeSplits[cascade] = sliceFar;
+
+		//Points along each corner ray are linear in view depth, so the slice's corners are a lerp between the near and far ones
+		glm::vec3 sliceCorners[8];
+		glm::vec3 centre(0.0f);
+		for (int i = 0; i < 4; i++)
+		{
+			glm::vec3 ray = farCorners[i] - nearCorners[i];
+			sliceCorners[i] = nearCorners[i] + ray * ((sliceNear - _cameraNearPlane) / (_cameraFarPlane - _cameraNearPlane));
+			sliceCorners[i + 4] = nearCorners[i] + ray * ((sliceFar - _cameraNearPlane) / (_cameraFarPlane - _cameraNearPlane));
+			centre += sliceCorners[i] + sliceCorners[i + 4];
+		}
+		centre /= 8.0f;
+
+		//A bounding sphere keeps the projection the same size however the camera turns, rounded up so it doesn't flicker
+		float radius = 0.0f;
+		for (int i = 0; i < 8; i++)
+		{
+			radius = glm::max(radius, glm::length(sliceCorners[i] - centre));
+		}
+		radius = ceil(radius * 16.0f) / 16.0f;
+
+		//Never cover more than the scene, whichever is smaller sets the size. A snapping step either side covers the snapping below.
+		glm::vec3 lightSpaceCentre = glm::vec3(lightView * glm::vec4(centre, 1.0f));
+		glm::vec3 lightSpaceSize = _lightSpaceBoundsMax - _lightSpaceBoundsMin;
+		float halfSize = glm::min(radius, 0.5f * glm::max(lightSpaceSize.x, lightSpaceSize.y)) * (float)CASCADE_TILE_SIZE / (float)(CASCADE_TILE_SIZE - 2 * CASCADE_SNAP_TEXELS);
+
+		//Slide the square back over the scene, a slice hanging off the edge of it has nothing to shadow there
+		for (int axis = 0; axis < 2; axis++)
+		{
+			float low = _lightSpaceBoundsMin[axis] + halfSize, high = _lightSpaceBoundsMax[axis] - halfSize;
+			lightSpaceCentre[axis] = low <= high ? glm::clamp(lightSpaceCentre[axis], low, high) : 0.5f * (_lightSpaceBoundsMin[axis] + _lightSpaceBoundsMax[axis]);
+		}
+
+		//Snap the centre to whole steps of shadow map texels in light space, so the texels don't swim as the camera moves
+		//and the static copy only has to be redrawn once the camera has moved a whole step
+		float snapSize = 2.0f * halfSize * (float)CASCADE_SNAP_TEXELS / (float)CASCADE_TILE_SIZE;
+		lightSpaceCentre.x = floor(lightSpaceCentre.x / snapSize) * snapSize;
+		lightSpaceCentre.y = floor(lightSpaceCentre.y / snapSize) * snapSize;
+
+		glm::mat4 cascadeProjection = glm::ortho(lightSpaceCentre.x - halfSize, lightSpaceCentre.x + halfSize,
+			lightSpaceCentre.y - halfSize, lightSpaceCentre.y + halfSize, near_plane, far_plane);
+		cascadeMatrices[cascade] = cascadeProjection * lightView;
+
+		sliceNear = sliceFar;
+	}
+}
 
+void Scene::UpdateStaticCache(ShadowAtlas& shadowAtlas)
+{
+	bool staticMoved = _objects.GetStaticVersion() != _staticVersion;
+	_staticVersion = _objects.GetStaticVersion();
 
-			//glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	_staticCascades.clear();
+	for (int i = 0; i < NUM_CASCADES; i++)
+	{
+		int tile = cascadeAtlasTiles[i];
+		if (tile < 0)
+		{
+			continue;
+		}
+
+		//The depth pass redraws it this frame, so it counts as cached from here on
+		if (staticMoved || cascadeMatrices[i] != _staticCascadeMatrices[i] || !shadowAtlas.IsStaticCached(tile))
+		{
+			shadowAtlas.SetStaticCached(tile, true);
+			_staticCascadeMatrices[i] = cascadeMatrices[i];
+			_staticCascades.push_back(i);
+		}
+	}
+}
+
+const Scene::ShaderUniforms& Scene::GetShaderUniforms(const Shader& shader)
+{
+	std::unordered_map<unsigned int, ShaderUniforms>::iterator it = _shaderUniforms.find(shader.getRevision());
+	if (it != _shaderUniforms.end())
+	{
+		return it->second;
+	}
+
+	ShaderUniforms& uniforms = _shaderUniforms[shader.getRevision()];
+	uniforms.depthMap = shader.getUniform<int>("depthMap");
+	uniforms.momentsMap = shader.getUniform<int>("momentsMap");
+	uniforms.cascadeIndex = shader.getUniform<int>("cascadeIndex");
+	return uniforms;
+}
+
+void Scene::Draw(Shader& shader)
+{
+	// Activate the shader program
+	//glUseProgram( _shaderProgram );
+
+	shader.use();
+
+	//Uniform locations were looked up once, so this is just glUniform calls
+	//Camera and light data come from the uniform buffer set up in UpdateUniformBuffers
+	const ShaderUniforms& uniforms = GetShaderUniforms(shader);
+	uniforms.depthMap.set(0);
+	uniforms.momentsMap.set(1);
+
+	/* Draw every cube */
+
+	// Transforms and materials come from the object table, uploaded at the end of Update
+	_objects.Draw( );
 
 	// Technically we can do this, but it makes no real sense because we must always have a valid shader program to draw geometry
 	glUseProgram( 0 );
 }
 
+void Scene::DrawShadowCasters(Shader& shader, ShadowAtlas& shadowAtlas)
+{
+	shader.use();
+
+	//The depth shader squeezes each cascade's view into its tile, these clip away whatever falls outside it
+	for (int i = 0; i < 4; i++)
+	{
+		glEnable(GL_CLIP_DISTANCE0 + i);
+	}
 
+	//One pass per cascade, the shader picks the cascade's matrix and tile from the light data
+	const ShaderUniforms& uniforms = GetShaderUniforms(shader);
+
+	//Redraw the static copies that are out of date with only the static objects
+	if (!_staticCascades.empty())
+	{
+		glBindFramebuffer(GL_FRAMEBUFFER, shadowAtlas.GetStaticFramebuffer());
+		glEnable(GL_SCISSOR_TEST);
+		for (unsigned int i = 0; i < _staticCascades.size(); i++)
+		{
+			int tile = cascadeAtlasTiles[_staticCascades[i]];
+			glScissor(shadowAtlas.GetTileX(tile), shadowAtlas.GetTileY(tile), shadowAtlas.GetTileSize(tile), shadowAtlas.GetTileSize(tile));
+			glClear(GL_DEPTH_BUFFER_BIT);
+		}
+		glDisable(GL_SCISSOR_TEST);
+
+		for (unsigned int i = 0; i < _staticCascades.size(); i++)
+		{
+			uniforms.cascadeIndex.set(_staticCascades[i]);
+			_objects.Draw(false, ObjectTable::DRAW_STATIC, true);
+		}
+	}
+
+	//Copying the static copy in takes the place of clearing the tile, then only the moving objects are drawn
+	for (int i = 0; i < NUM_CASCADES; i++)
+	{
+		if (cascadeAtlasTiles[i] >= 0)
+		{
+			shadowAtlas.CopyStaticTile(cascadeAtlasTiles[i]);
+		}
+	}
+
+	glBindFramebuffer(GL_FRAMEBUFFER, shadowAtlas.GetFramebuffer());
+	for (int i = 0; i < NUM_CASCADES; i++)
+	{
+		uniforms.cascadeIndex.set(i);
+		_objects.Draw(false, ObjectTable::DRAW_DYNAMIC, true);
+	}
+
+	for (int i = 0; i < 4; i++)
+	{
+		glDisable(GL_CLIP_DISTANCE0 + i);
+	}
+
+	glUseProgram( 0 );
+}
+
+void Scene::SetShadowVariant(const ShadowVariant& variant)
+{
+	_shadowVariant = variant;
+
+	//The gathers cover the kernel two texels at a time, so it has to be odd
+	_shadowVariant.kernelSize = glm::clamp(variant.kernelSize | 1, 3, 7);
+}
+
+void Scene::FilterShadowMoments(ShadowMoments& shadowMoments, ShadowAtlas& shadowAtlas)
+{
+	if (_shadowVariant.technique != ShadowVariant::TECHNIQUE_EVSM)
+	{
+		return;
+	}
+
+	for (int i = 0; i < NUM_CASCADES; i++)
+	{
+		int tile = cascadeAtlasTiles[i];
+		if (tile >= 0)
+		{
+			shadowMoments.FilterTile(shadowAtlas.GetTexture(), shadowAtlas.GetTileX(tile), shadowAtlas.GetTileY(tile), shadowAtlas.GetTileSize(tile));
+		}
+	}
+	shadowMoments.GenerateMipmaps();
+}
@@ -1,6 +1,10 @@
 #define glCheckError() glCheckError_(__FILE__, __LINE__) 
 
 #include "Cube.h"
+#include "ObjectTable.h"
+#include "ShadowAtlas.h"
+#include "ShadowMoments.h"
+#include "ShadowVariant.h"
 
 
 // The GLM library contains vector and matrix functions and classes for us to use
@@ -9,9 +13,11 @@
 #include <GLM/gtc/matrix_transform.hpp> // This one lets us use matrix transformations
 #include <GLM/gtc/type_ptr.hpp> // This one gives us access to a utility function which makes sending data to OpenGL nice and easy
 #include <iostream>
+#include <unordered_map>
+#include <vector>
 
+#include "Shader.h"
 
-class Shader;
 class Scene
 {
 public:
@@ -24,8 +30,38 @@ public:
 	
 	void Update( float deltaTs );
 
+	// Uploads the camera and light data shared by every shader program
+	// The light's shadow map gets its tile in the shadow atlas here
+	// Call this once per frame after ShadowAtlas::BeginFrame, before any of the Draw passes
+	void UpdateUniformBuffers(ShadowAtlas& shadowAtlas);
 
-	void Draw(Shader shader);
+	void Draw(Shader& shader);
+
+	// Renders the shadow casters into each cascade's tile of the shadow atlas, the tiles don't need clearing first
+	// Static objects are only drawn into static copies that are out of date, each tile starts from its static copy and the moving objects go on top
+	void DrawShadowCasters(Shader& shader, ShadowAtlas& shadowAtlas);
+
+	// Which compile-time variant of the lit shader's shadow lookup to draw with, Draw must be given a program built for it
+	void SetShadowVariant(const ShadowVariant& variant);
+	const ShadowVariant& GetShadowVariant() const { return _shadowVariant; }
+
+	// Filters every cascade's tile into the moments texture, does nothing unless the variant is EVSM
+	// Call this after DrawShadowCasters
+	void FilterShadowMoments(ShadowMoments& shadowMoments, ShadowAtlas& shadowAtlas);
+
+	unsigned int GetNumObjects() const { return _objects.GetNumObjects(); }
+
+	// Triangles a pass that draws every object submits, all the objects share the cube mesh
+	unsigned int GetNumObjectTriangles() const { return _objects.GetNumObjects() * (_cubeModel.GetNumVertices() / 3); }
+
+	// Adds a grid of count small static cubes over the floor, to check how the passes cope with a large number of objects
+	void AddCubeField(unsigned int count);
+
+	// Number of shadow cascades the camera frustum is split into, this must match NUM_CASCADES in uniformBlocks.txt
+	enum { NUM_CASCADES = 4 };
+
+	// Size of each cascade's tile in the shadow atlas
+	enum { CASCADE_TILE_SIZE = 256 };
 
 
 protected:
@@ -36,20 +72,61 @@ protected:
 	glm::mat4 _modelMatrixCube1;
 	glm::mat4 _modelMatrixCube2;
 	glm::mat4 _modelMatrixCube3;
+
+	// Every object in the scene, the cubes' transforms are written to it once per frame
+	ObjectTable _objects;
+	unsigned int _cube1Object, _cube2Object, _cube3Object;
+
+	// Writes a cube's transform to the object table, a cube the table had no room for is INVALID_ID and is skipped
+	void SetCubeTransform(unsigned int object, const glm::mat4& modelMat);
 		
 	// All cubes share the same viewing matrix - this defines the camera's orientation and position
 	glm::mat4 _viewMatrix;
 	
 	// The projection matrix defines the camera's view (like its lens)
 	glm::mat4 _projMatrix;
+	float _cameraNearPlane, _cameraFarPlane;
 
-	//Light Projection
-	glm::mat4 lightProjection;
+	//Light View, every cascade looks down it
 	glm::mat4 lightView;
-	glm::mat4 lightSpaceMatrix;
-	glm::mat4 lightModelMatrix;
 	glm::vec3 lightPos;
 
+	//Each cascade covers one slice of the camera frustum with its own orthographic light projection and its own tile of the atlas
+	//cascadeSplits holds the view space depth each slice ends at, cascadeTiles the scale and offset ShadowAtlas::GetTileScaleOffset gives
+	glm::mat4 cascadeMatrices[NUM_CASCADES];
+	glm::vec4 cascadeTiles[NUM_CASCADES];
+	float cascadeSplits[NUM_CASCADES];
+
+	//The atlas tile of each cascade, -1 for none
+	int cascadeAtlasTiles[NUM_CASCADES];
+
+	//Blend between logarithmic (1) and uniform (0) split distances, the practical split scheme
+	float _cascadeSplitLambda;
+
+	//Box around every object, rounded out to a grid and grown rather than refitted until it is a unit too big, so small movements don't change it
+	//The cascades never cover more than it, and the light's near and far planes are fitted to it
+	glm::vec3 _sceneBoundsMin, _sceneBoundsMax;
+	bool UpdateSceneBounds();
+
+	//The scene bounds in light view space, the light looks down -z
+	glm::vec3 _lightSpaceBoundsMin, _lightSpaceBoundsMax;
+
+	//Fits every cascade's light projection around its slice of the camera frustum
+	//Its centre snaps in steps of CASCADE_SNAP_TEXELS texels, so small camera moves leave the matrix, and the static copy drawn with it, as they were
+	//Each side of the tile keeps that many texels spare to cover the snapping, at that much cost in resolution
+	void UpdateCascades();
+	enum { CASCADE_SNAP_TEXELS = 16 };
+
+	//Picks the cascades whose static copy in the atlas is out of date, from a static object moving, the cascade moving or the tile being reallocated
+	//_staticCascadeMatrices are the matrices each static copy was drawn with, _staticCascades the cascades redrawn this frame
+	void UpdateStaticCache(ShadowAtlas& shadowAtlas);
+	unsigned int _staticVersion;
+	glm::mat4 _staticCascadeMatrices[NUM_CASCADES];
+	std::vector<int> _staticCascades;
+
+	//The cascades are redrawn every frame, so with EVSM they are all filtered every frame too
+	ShadowVariant _shadowVariant;
+
 
 	// Angle of rotation for our cube
 	float _cube1Angle;
@@ -58,16 +135,44 @@ protected:
 	float near_plane, far_plane;
 
 
+	// Uniform buffer binding points, these must match the bindings declared in the shaders
+	enum { FRAME_UBO_BINDING = 0, LIGHT_UBO_BINDING = 1 };
+
+	// std140 mirror of the FrameData block in the shaders
+	struct FrameUniformData
+	{
+		glm::mat4 viewMat;
+		glm::mat4 projMat;
+		glm::vec4 worldSpaceLightPos;
+	};
+
+	// std140 mirror of the LightData block in the shaders
+	struct LightUniformData
+	{
+		glm::mat4 cascadeMatrices[NUM_CASCADES];
+		glm::vec4 cascadeTiles[NUM_CASCADES];
+		glm::vec4 cascadeSplits;
+		float nearPlane;
+		float farPlane;
+		float padding[2];
+	};
+
+	// One buffer holds both blocks so the whole frame goes up in a single glBufferSubData
+	GLuint _uniformBuffer;
+	GLintptr _lightBlockOffset;
+	GLsizeiptr _uniformBufferSize;
+	std::vector<unsigned char> _uniformStaging;
+
 	// These are for storing the Uniform locations of shader variables
 	// We need these so we can send Uniform data to them
-	GLint _shaderModelMatLocation;
-	GLint _shaderViewMatLocation;
-	GLint _shaderProjMatLocation;
-	GLint _lightSpaceMatrixLocation;
-	GLint _textureLocation;
-	GLint _nearplane;
-	GLint _farplane;
-
-	GLint _shaderDiffuseColLocation, _shaderEmissiveColLocation;
-	GLint _shaderWSLightPosLocation;
+	struct ShaderUniforms
+	{
+		Uniform<int> depthMap;
+		Uniform<int> momentsMap;
+		Uniform<int> cascadeIndex;
+	};
+
+	// Handles are resolved the first time a program is drawn with, keyed by its revision so a reloaded program gets them again
+	std::unordered_map<unsigned int, ShaderUniforms> _shaderUniforms;
+	const ShaderUniforms& GetShaderUniforms(const Shader& shader);
 };
@@ -0,0 +1,111 @@
+
+#include "ShadowVariant.h"
+#include <cmath>
+#include <sstream>
+#include <vector>
+
+ShadowVariant::ShadowVariant()
+{
+	technique = TECHNIQUE_PCF;
+	kernelSize = 3;
+	pattern = PATTERN_GRID;
+	bias = BIAS_SLOPE_SCALED;
+}
+
+ShadowVariant::ShadowVariant(unsigned int features)
+{
+	technique = (Technique)((features >> TECHNIQUE_SHIFT) & 1);
+	kernelSize = 3 + 2 * (int)((features >> KERNEL_SHIFT) & FIELD_MASK);
+	pattern = (SamplePattern)((features >> PATTERN_SHIFT) & FIELD_MASK);
+	bias = (BiasModel)((features >> BIAS_SHIFT) & 1);
+}
+
+unsigned int ShadowVariant::GetFeatures() const
+{
+	unsigned int features = ((unsigned int)technique << TECHNIQUE_SHIFT) | ((unsigned int)bias << BIAS_SHIFT);
+
+	//EVSM doesn't use the PCF kernel, so every kernel and pattern shares one EVSM program
+	if (technique == TECHNIQUE_PCF)
+	{
+		features |= ((unsigned int)(kernelSize - 3) / 2) << KERNEL_SHIFT;
+		features |= (unsigned int)pattern << PATTERN_SHIFT;
+	}
+	return features;
+}
+
+//Poisson disk of numTaps points in the unit circle, by best candidate sampling from a fixed seed so every run gets the same table
+//Each new point is the one of a batch of random candidates that lands furthest from the points so far
+static void GeneratePoissonDisk(int numTaps, std::vector<float>& taps)
+{
+	unsigned int seed = 12345u;
+	taps.clear();
+	for (int i = 0; i < numTaps; i++)
+	{
+		float bestX = 0.0f, bestY = 0.0f, bestDistance = -1.0f;
+		for (int candidate = 0; candidate < 32 * (i + 1); candidate++)
+		{
+			//Uniform point in the circle, from two steps of a linear congruential generator
+			seed = seed * 1664525u + 1013904223u;
+			float radius = sqrtf((float)(seed >> 8) / 16777216.0f);
+			seed = seed * 1664525u + 1013904223u;
+			float angle = 6.2831853f * (float)(seed >> 8) / 16777216.0f;
+			float x = radius * cosf(angle), y = radius * sinf(angle);
+
+			float nearest = 4.0f;
+			for (unsigned int j = 0; j < taps.size(); j += 2)
+			{
+				float dx = x - taps[j], dy = y - taps[j + 1];
+				nearest = fminf(nearest, dx * dx + dy * dy);
+			}
+			if (nearest > bestDistance)
+			{
+				bestX = x, bestY = y, bestDistance = nearest;
+			}
+		}
+		taps.push_back(bestX);
+		taps.push_back(bestY);
+	}
+}
+
+std::string ShadowVariant::GetDefines() const
+{
+	std::ostringstream defines;
+	defines << "#define SHADOW_TECHNIQUE " << (int)technique << "\n";
+	defines << "#define SHADOW_KERNEL_SIZE " << kernelSize << "\n";
+	defines << "#define SHADOW_PATTERN " << (int)pattern << "\n";
+	defines << "#define SHADOW_BIAS " << (int)bias << "\n";
+
+	//The disk is only worth generating for the patterns that read it
+	if (technique == TECHNIQUE_PCF && pattern != PATTERN_GRID)
+	{
+		std::vector<float> taps;
+		GeneratePoissonDisk(GetNumTaps(), taps);
+
+		defines << "#define SHADOW_NUM_TAPS " << GetNumTaps() << "\n";
+		defines << "#define SHADOW_POISSON_TAPS vec2[](";
+		defines.setf(std::ios::fixed);
+		defines.precision(5);
+		for (unsigned int i = 0; i < taps.size(); i += 2)
+		{
+			defines << (i > 0 ? ", " : "") << "vec2(" << taps[i] << ", " << taps[i + 1] << ")";
+		}
+		defines << ")\n";
+	}
+	return defines.str();
+}
+
+std::string ShadowVariant::GetName() const
+{
+	const char* patternNames[NUM_PATTERNS] = { "grid", "Poisson", "rotated Poisson" };
+	std::ostringstream name;
+	if (technique == TECHNIQUE_EVSM)
+	{
+		name << "EVSM";
+	}
+	else
+	{
+		name << "PCF " << kernelSize << "x" << kernelSize << " " << patternNames[pattern];
+	}
+	name << (bias == BIAS_SLOPE_SCALED ? " slope bias" : " constant bias");
+	return name.str();
+}
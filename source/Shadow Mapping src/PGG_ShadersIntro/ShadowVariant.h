@@ -0,0 +1,50 @@
+#ifndef __SHADOWVARIANT_H__
+#define __SHADOWVARIANT_H__
+
+#include <string>
+
+// One compile-time specialisation of the lit shader's shadow lookup
+// Every field becomes a #define, so the kernel loops have constant bounds the compiler can unroll and the sample tables are exactly the size used
+struct ShadowVariant
+{
+	// PCF compares depths in the atlas, EVSM does one filtered fetch of the moments texture
+	enum Technique { TECHNIQUE_PCF, TECHNIQUE_EVSM, NUM_TECHNIQUES };
+
+	// Grid is a weighted textureGather kernel, Poisson scatters bilinear compares over a disk, rotated Poisson turns the disk per pixel to trade banding for noise
+	enum SamplePattern { PATTERN_GRID, PATTERN_POISSON, PATTERN_ROTATED_POISSON, NUM_PATTERNS };
+
+	// Constant bias is the same everywhere, slope scaled grows as the surface turns away from the light
+	enum BiasModel { BIAS_CONSTANT, BIAS_SLOPE_SCALED, NUM_BIAS_MODELS };
+
+	ShadowVariant();
+
+	// Unpacks a feature mask made by GetFeatures
+	explicit ShadowVariant(unsigned int features);
+
+	Technique technique;
+
+	// Width of the PCF kernel in texels, 3, 5 or 7. The grid takes one textureGather per 2x2 texels, Poisson as many bilinear compares.
+	int kernelSize;
+	SamplePattern pattern;
+	BiasModel bias;
+
+	// Number of PCF fetches per light per fragment
+	int GetNumTaps() const { return ((kernelSize + 1) / 2) * ((kernelSize + 1) / 2); }
+
+	// Layout of the feature mask the lit shader is looked up with in the ShaderLibrary
+	enum FeatureBits { TECHNIQUE_SHIFT = 0, KERNEL_SHIFT = 1, PATTERN_SHIFT = 3, BIAS_SHIFT = 5, FIELD_MASK = 3 };
+
+	// The variant packed into a feature mask, different for every program that compiles differently
+	unsigned int GetFeatures() const;
+
+	// The #define block the shader is compiled with, see Shader
+	std::string GetDefines() const;
+
+	// The ShaderLibrary defines function for the lit shader
+	static std::string GetFeatureDefines(unsigned int features) { return ShadowVariant(features).GetDefines(); }
+
+	// Short description for the window title
+	std::string GetName() const;
+};
+
+#endif